@@ -0,0 +1,598 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "segmenter.h"
+#include "count_table.h"
+#include "model_writer.h"
+
+
+/**
+ * benchmarks of training: the hot loops on their own (microbenchmarks) and whole train runs on
+ * synthetic corpora of growing size (end to end). everything is reported as one JSON object,
+ * so that two builds can be compared number by number.
+ * the corpora depend on nothing but the seed: the generator only uses the raw output of mt19937_64,
+ * which the standard fixes, and none of the library distributions, which it does not.
+ */
+
+#ifdef _WIN32
+#define PATH_DELIMITER '\\'
+#else
+#define PATH_DELIMITER '/'
+#endif
+
+/**
+ * a uniform double in [0, 1) from the top 53 bits
+ */
+inline double uniform01(std::mt19937_64 &rng) {
+    return (double) (rng() >> 11u) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * rank r (0-based) of n is drawn with a probability proportional to 1 / (r + 1)^exponent
+ */
+class ZipfTable {
+public:
+    ZipfTable(size_t n, double exponent) : cdf(n) {
+        double sum = 0;
+        for (size_t r = 0; r < n; r++) {
+            sum += 1.0 / std::pow((double) (r + 1), exponent);
+            cdf[r] = sum;
+        }
+        for (double &c : cdf) {
+            c /= sum;
+        }
+    }
+
+    size_t sample(std::mt19937_64 &rng) const {
+        size_t r = std::upper_bound(cdf.begin(), cdf.end(), uniform01(rng)) - cdf.begin();
+        return r < cdf.size() ? r : cdf.size() - 1;
+    }
+
+private:
+    std::vector<double> cdf;
+};
+
+/**
+ * passwords made of a Zipf-distributed structure whose letter, digit and special runs are in turn
+ * Zipf-distributed picks from a pool per class and length, e.g. L6D2 -> "monkey" + "12".
+ * for example,
+ * SyntheticCorpus corpus(42);
+ * std::string line;
+ * corpus.next(line);
+ */
+class SyntheticCorpus {
+public:
+    static const int MAX_LETTERS = 12;
+    static const int MAX_DIGITS = 10;
+    static const int MAX_SPECIALS = 3;
+    static const size_t STRUCTURES = 5000;
+    static const size_t POOL_SIZE = 4000;
+
+    explicit SyntheticCorpus(uint64_t seed, double exponent = 1.0)
+            : rng(seed), structure_ranks(STRUCTURES, exponent), token_ranks(POOL_SIZE, exponent) {
+        const char specials[] = "!@#$%^&*._-+=?~";
+        for (int length = 1; length <= MAX_LETTERS; length++) {
+            pools[CLASS_LETTER].push_back(make_pool(length, [this](size_t i) {
+                char c = (char) ('a' + rng() % 26);
+                return i == 0 && rng() % 10 == 0 ? (char) (c - 'a' + 'A') : c;
+            }));
+        }
+        for (int length = 1; length <= MAX_DIGITS; length++) {
+            pools[CLASS_DIGIT].push_back(make_pool(length, [this](size_t) { return (char) ('0' + rng() % 10); }));
+        }
+        for (int length = 1; length <= MAX_SPECIALS; length++) {
+            pools[CLASS_SPECIAL].push_back(make_pool(length, [this, &specials](size_t) {
+                return specials[rng() % (sizeof(specials) - 1)];
+            }));
+        }
+        for (size_t i = 0; i < STRUCTURES; i++) {
+            std::vector<Run> structure;
+            int runs = 1 + (int) (rng() % 4);
+            int cls = -1;
+            for (int r = 0; r < runs; r++) {
+                // no two runs of the same class next to each other
+                int next;
+                do {
+                    next = (int) (rng() % 3);
+                } while (next == cls);
+                cls = next;
+                int max_length = cls == CLASS_LETTER ? MAX_LETTERS : cls == CLASS_DIGIT ? MAX_DIGITS : MAX_SPECIALS;
+                structure.push_back(Run{cls, 1 + (int) (rng() % max_length)});
+            }
+            structures.push_back(structure);
+        }
+    }
+
+    void next(std::string &line) {
+        line.clear();
+        for (const Run &run : structures[structure_ranks.sample(rng)]) {
+            line += pools[run.cls][run.length - 1][token_ranks.sample(rng)];
+        }
+    }
+
+    /**
+     * every word of the letter pools, one dictionary for train
+     */
+    std::vector<std::string> words() const {
+        std::vector<std::string> all;
+        for (const std::vector<std::string> &pool : pools[CLASS_LETTER]) {
+            all.insert(all.end(), pool.begin(), pool.end());
+        }
+        return all;
+    }
+
+private:
+    struct Run {
+        int cls;
+        int length;
+    };
+
+    template<typename NextChar>
+    std::vector<std::string> make_pool(int length, const NextChar &next_char) {
+        std::vector<std::string> pool(POOL_SIZE);
+        for (std::string &token : pool) {
+            for (int i = 0; i < length; i++) {
+                token += next_char((size_t) i);
+            }
+        }
+        return pool;
+    }
+
+    std::mt19937_64 rng;
+    ZipfTable structure_ranks;
+    ZipfTable token_ranks;
+    // by CharClass, then by length - 1
+    std::vector<std::vector<std::string> > pools[3];
+    std::vector<std::vector<Run> > structures;
+};
+
+/**
+ * lines kept back to back in memory, the microbenchmarks run over them
+ */
+struct LineBuffer {
+    std::string text;
+    std::vector<uint32_t> starts;
+
+    size_t size() const {
+        return starts.size() - 1;
+    }
+
+    const char *line(size_t i) const {
+        return text.data() + starts[i];
+    }
+
+    int line_size(size_t i) const {
+        return (int) (starts[i + 1] - starts[i]);
+    }
+};
+
+/**
+ * the best of several runs of one microbenchmark
+ */
+struct MicroResult {
+    std::string name;
+    double seconds;
+    // lines, inserts, lines written or keys smoothed
+    long long items;
+    long long bytes;
+    // the distinct keys, or the runs the segmenter found
+    long long keys;
+    long long memory_bytes;
+};
+
+std::string train_path;
+std::string work_dir;
+uint64_t seed = 42;
+int repeat = 3;
+int threads = 1;
+long long micro_lines = 1000000;
+std::vector<long long> end_to_end_lines{1000000, 10000000, 100000000};
+
+void help();
+
+bool parse_sizes(const char *arg, std::vector<long long> &sizes);
+
+double seconds_since(std::chrono::steady_clock::time_point start);
+
+template<typename Run>
+MicroResult best_of(const std::string &name, const Run &run);
+
+bool write_corpus(const std::string &path, long long lines, long long &bytes);
+
+bool write_dictionary(const std::string &path);
+
+bool run_train(const std::string &corpus, const std::string &model, const std::string &report);
+
+void remove_model(const std::string &model);
+
+bool read_file(const std::string &path, std::string &content);
+
+double report_number(const std::string &report, const std::string &name, const char *field);
+
+void print_micro(std::FILE *out, const MicroResult &result, bool last);
+
+int main(int argc, char *argv[]) {
+    std::string output_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--help") {
+            help();
+        } else if (arg == "--train" && has_value) {
+            train_path = argv[++i];
+        } else if (arg == "--work-dir" && has_value) {
+            work_dir = argv[++i];
+        } else if (arg == "--output" && has_value) {
+            output_path = argv[++i];
+        } else if (arg == "--seed" && has_value) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "--repeat" && has_value) {
+            repeat = (int) strtol(argv[++i], nullptr, 0);
+        } else if (arg == "--threads" && has_value) {
+            threads = (int) strtol(argv[++i], nullptr, 0);
+        } else if (arg == "--micro-lines" && has_value) {
+            micro_lines = strtoll(argv[++i], nullptr, 0);
+        } else if (arg == "--lines" && has_value) {
+            if (!parse_sizes(argv[++i], end_to_end_lines)) {
+                std::cerr << "Error: --lines takes sizes separated by commas, e.g. 1000000,10000000" << std::endl;
+                return -1;
+            }
+        } else {
+            std::cerr << "Error: unknown argument " << arg << std::endl;
+            help();
+        }
+    }
+    if (repeat < 1 || threads < 1 || micro_lines < 1) {
+        std::cerr << "Error: --repeat, --threads and --micro-lines should be at least 1!" << std::endl;
+        return -1;
+    }
+    if (train_path.empty()) {
+        // next to this binary, where both the makefile and cmake put it
+        std::string self = argv[0];
+        size_t slash = self.rfind(PATH_DELIMITER);
+        train_path = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + PATH_DELIMITER + "train";
+    }
+    if (work_dir.empty()) {
+        work_dir = "bench_work";
+    }
+    if (work_dir[work_dir.size() - 1] != PATH_DELIMITER) {
+        work_dir += PATH_DELIMITER;
+    }
+#ifdef _WIN32
+    mkdir(work_dir.c_str());
+#else
+    mkdir(work_dir.c_str(), 0744);
+#endif
+    std::FILE *out = output_path.empty() ? stdout : std::fopen(output_path.c_str(), "w");
+    if (out == nullptr) {
+        std::cerr << "Error: could not write " << output_path << std::endl;
+        return -1;
+    }
+
+    // microbenchmarks, all over the same lines in memory
+    std::cerr << "[Bench]: generating " << micro_lines << " lines" << std::endl;
+    LineBuffer lines;
+    {
+        SyntheticCorpus corpus(seed);
+        std::string line;
+        lines.starts.push_back(0);
+        for (long long i = 0; i < micro_lines; i++) {
+            corpus.next(line);
+            lines.text += line;
+            lines.starts.push_back((uint32_t) lines.text.size());
+        }
+    }
+    std::vector<MicroResult> micro;
+    std::cerr << "[Bench]: segmenter" << std::endl;
+    micro.push_back(best_of("segmenter", [&lines](MicroResult &result) {
+        Segmenter segmenter;
+        std::string structure;
+        for (size_t i = 0; i < lines.size(); i++) {
+            segmenter.split(lines.line(i), lines.line_size(i));
+            segmenter.structure_key(structure);
+            result.keys += (long long) segmenter.segments().size();
+        }
+        result.items = (long long) lines.size();
+        result.bytes = (long long) lines.text.size();
+    }));
+    std::cerr << "[Bench]: count table" << std::endl;
+    micro.push_back(best_of("count_table_insert", [&lines](MicroResult &result) {
+        Segmenter segmenter;
+        CountTable table;
+        for (size_t i = 0; i < lines.size(); i++) {
+            const char *line = lines.line(i);
+            segmenter.split(line, lines.line_size(i));
+            for (const Segment &run : segmenter.segments()) {
+                table.add(line + run.offset, (size_t) run.length);
+                result.items++;
+            }
+        }
+        result.bytes = (long long) lines.text.size();
+        result.keys = (long long) table.size();
+        result.memory_bytes = (long long) table.memory_bytes();
+    }));
+    // the same entries for every run of the writer: every distinct digit run with its share of the count
+    std::vector<std::pair<std::string, float> > entries;
+    {
+        Segmenter segmenter;
+        CountTable digits;
+        for (size_t i = 0; i < lines.size(); i++) {
+            const char *line = lines.line(i);
+            segmenter.split(line, lines.line_size(i));
+            for (const Segment &run : segmenter.segments()) {
+                if (run.cls == CLASS_DIGIT) {
+                    digits.add(line + run.offset, (size_t) run.length);
+                }
+            }
+        }
+        digits.sort();
+        for (const CountEntry &entry : digits.entries()) {
+            entries.emplace_back(entry.str(), (float) entry.count / (float) micro_lines);
+        }
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const std::pair<std::string, float> &a, const std::pair<std::string, float> &b) {
+                             return a.second > b.second;
+                         });
+    }
+    std::cerr << "[Bench]: model writing" << std::endl;
+    std::string written_file = work_dir + "written.txt";
+    micro.push_back(best_of("model_writing", [&entries, &written_file](MicroResult &result) {
+        BufferedFileWriter fout;
+        fout.open(written_file);
+        for (const std::pair<std::string, float> &entry : entries) {
+            fout.write(entry.first);
+            fout.put('\t');
+            fout.write_number(entry.second);
+            fout.put('\n');
+        }
+        fout.close();
+        struct stat st{};
+        if (stat(written_file.c_str(), &st) == 0) {
+            result.bytes = (long long) st.st_size;
+        }
+        result.items = (long long) entries.size();
+    }));
+    std::remove(written_file.c_str());
+
+    // smoothing is not a library function, it is timed by train itself (--report) on the micro corpus
+    std::string dictionary = work_dir + "dictionary.txt";
+    bool have_train = access(train_path.c_str(), X_OK) == 0 && write_dictionary(dictionary);
+    if (!have_train) {
+        std::cerr << "[Bench]: no train at " << train_path << ", only the microbenchmarks are run" << std::endl;
+    } else {
+        std::cerr << "[Bench]: smoothing" << std::endl;
+        std::string corpus = work_dir + "micro.txt", model = work_dir + "micro_model", report = work_dir + "micro.json";
+        long long bytes = 0;
+        const char *folders[] = {"digits", "special"};
+        std::vector<MicroResult> smoothing;
+        for (const char *folder : folders) {
+            smoothing.push_back(MicroResult{std::string(folder) + "_smoothing", 0, 0, 0, 0, 0});
+        }
+        for (int r = 0; r < repeat && write_corpus(corpus, micro_lines, bytes); r++) {
+            std::string content;
+            if (!run_train(corpus, model, report) || !read_file(report, content)) {
+                break;
+            }
+            for (int kind = 0; kind < 2; kind++) {
+                std::string folder = folders[kind];
+                double seconds = report_number(content, folder + ": smoothing", "wall_seconds")
+                                 + report_number(content, folder + ": sorting", "wall_seconds");
+                if (r == 0 || seconds < smoothing[kind].seconds) {
+                    smoothing[kind].seconds = seconds;
+                }
+                smoothing[kind].items = (long long) (report_number(content, folder + " (long)", "distinct_keys")
+                                                     + report_number(content, folder + " (short)", "distinct_keys"));
+                smoothing[kind].keys = smoothing[kind].items;
+            }
+        }
+        micro.insert(micro.end(), smoothing.begin(), smoothing.end());
+        remove_model(model);
+        std::remove(corpus.c_str());
+        std::remove(report.c_str());
+    }
+
+    std::fprintf(out, "{\n  \"seed\": %llu,\n  \"repeat\": %d,\n  \"threads\": %d,\n  \"micro_lines\": %lld,\n",
+                 (unsigned long long) seed, repeat, threads, micro_lines);
+    std::fprintf(out, "  \"micro\": [");
+    for (size_t i = 0; i < micro.size(); i++) {
+        print_micro(out, micro[i], i + 1 == micro.size());
+    }
+    std::fprintf(out, "\n  ],\n  \"end_to_end\": [");
+
+    // end to end: generate, train with --report, keep what train measured
+    bool first = true;
+    for (long long size : have_train ? end_to_end_lines : std::vector<long long>()) {
+        std::string corpus = work_dir + "corpus-" + std::to_string(size) + ".txt";
+        std::string model = work_dir + "model-" + std::to_string(size);
+        std::string report = work_dir + "report-" + std::to_string(size) + ".json";
+        std::cerr << "[Bench]: end to end, " << size << " lines" << std::endl;
+        long long bytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = write_corpus(corpus, size, bytes);
+        double generate_seconds = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        ok = ok && run_train(corpus, model, report);
+        double train_seconds = seconds_since(start);
+        std::string content;
+        ok = ok && read_file(report, content);
+        std::remove(corpus.c_str());
+        std::remove(report.c_str());
+        remove_model(model);
+        if (!ok) {
+            std::cerr << "[Bench]: the run with " << size << " lines failed" << std::endl;
+            continue;
+        }
+        while (!content.empty() && (content.back() == '\n' || content.back() == ' ')) {
+            content.pop_back();
+        }
+        std::fprintf(out, "%s\n    {\"lines\": %lld, \"bytes\": %lld, \"generate_seconds\": %.3f, "
+                          "\"train_seconds\": %.3f, \"lines_per_second\": %.0f, \"bytes_per_second\": %.0f,\n"
+                          "     \"report\": %s}", first ? "" : ",", size, bytes, generate_seconds, train_seconds,
+                     (double) size / train_seconds, (double) bytes / train_seconds, content.c_str());
+        first = false;
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    if (out != stdout && std::fclose(out) != 0) {
+        std::cerr << "Error: could not write " << output_path << std::endl;
+        return -1;
+    }
+    std::remove(dictionary.c_str());
+    rmdir(work_dir.c_str());
+    return 0;
+}
+
+/**
+ * how to use
+ */
+void help() {
+    std::cout << "Usage Info:\n";
+    std::cout << "--train\t\t\tthe train binary to run end to end (next to this one)\n"
+                 "--work-dir\t\tcorpora and models are written here (bench_work)\n"
+                 "--output\t\tthe JSON results go here (stdout)\n"
+                 "--seed\t\t\tseed of the synthetic corpora (42)\n"
+                 "--repeat\t\truns of every microbenchmark, the best one counts (3)\n"
+                 "--threads\t\tthreads of train (1)\n"
+                 "--micro-lines\t\tlines of the microbenchmarks (1000000)\n"
+                 "--lines\t\t\tlines of the end to end runs (1000000,10000000,100000000)";
+    std::cout << std::endl;
+    std::exit(0);
+}
+
+/**
+ * "1000000,10000000" -> {1000000, 10000000}
+ */
+bool parse_sizes(const char *arg, std::vector<long long> &sizes) {
+    sizes.clear();
+    const char *p = arg;
+    while (*p != '\0') {
+        char *end;
+        long long size = strtoll(p, &end, 10);
+        if (end == p || size < 1 || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        sizes.push_back(size);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return !sizes.empty();
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * run(result) repeat times on a fresh result, the fastest run is kept
+ */
+template<typename Run>
+MicroResult best_of(const std::string &name, const Run &run) {
+    MicroResult best{name, 0, 0, 0, 0, 0};
+    for (int r = 0; r < repeat; r++) {
+        MicroResult result{name, 0, 0, 0, 0, 0};
+        auto start = std::chrono::steady_clock::now();
+        run(result);
+        result.seconds = seconds_since(start);
+        if (r == 0 || result.seconds < best.seconds) {
+            best = result;
+        }
+    }
+    return best;
+}
+
+/**
+ * the first lines of the corpus of seed, the same ones whatever the size
+ */
+bool write_corpus(const std::string &path, long long lines, long long &bytes) {
+    SyntheticCorpus corpus(seed);
+    BufferedFileWriter fout;
+    if (!fout.open(path)) {
+        return false;
+    }
+    std::string line;
+    bytes = 0;
+    for (long long i = 0; i < lines; i++) {
+        corpus.next(line);
+        fout.write(line);
+        fout.put('\n');
+        bytes += (long long) line.size() + 1;
+    }
+    return fout.close();
+}
+
+bool write_dictionary(const std::string &path) {
+    BufferedFileWriter fout;
+    if (!fout.open(path)) {
+        return false;
+    }
+    for (const std::string &word : SyntheticCorpus(seed).words()) {
+        fout.write(word);
+        fout.put('\n');
+    }
+    return fout.close();
+}
+
+bool run_train(const std::string &corpus, const std::string &model, const std::string &report) {
+    std::string command = "'" + train_path + "' --training-set '" + corpus + "' --trained-model '" + model
+                          + "' --dictionaries '" + work_dir + "dictionary.txt' --threads " + std::to_string(threads)
+                          + " --progress 0 --rm-existed --report '" + report + "' > /dev/null";
+    if (std::system(command.c_str()) != 0) {
+        std::cerr << "[Bench]: " << command << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void remove_model(const std::string &model) {
+    std::string command = "rm -rf '" + model + "'";
+    if (std::system(command.c_str()) != 0) {
+        std::cerr << "[Bench]: could not remove " << model << std::endl;
+    }
+}
+
+bool read_file(const std::string &path, std::string &content) {
+    std::FILE *fin = std::fopen(path.c_str(), "rb");
+    if (fin == nullptr) {
+        return false;
+    }
+    char buffer[1 << 16];
+    size_t n;
+    content.clear();
+    while ((n = std::fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+        content.append(buffer, n);
+    }
+    std::fclose(fin);
+    return true;
+}
+
+/**
+ * a number of the phase or table called name in the report of train, 0 if it is not there
+ */
+double report_number(const std::string &report, const std::string &name, const char *field) {
+    size_t at = report.find("\"name\": \"" + name + "\"");
+    if (at == std::string::npos) {
+        return 0;
+    }
+    size_t end = report.find('}', at);
+    size_t value = report.find("\"" + std::string(field) + "\": ", at);
+    if (value == std::string::npos || value > end) {
+        return 0;
+    }
+    return strtod(report.c_str() + value + strlen(field) + 4, nullptr);
+}
+
+void print_micro(std::FILE *out, const MicroResult &result, bool last) {
+    double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+    std::fprintf(out, "\n    {\"name\": \"%s\", \"seconds\": %.4f, \"items\": %lld, \"items_per_second\": %.0f, "
+                      "\"bytes_per_second\": %.0f, \"keys\": %lld, \"memory_bytes\": %lld}%s",
+                 result.name.c_str(), result.seconds, result.items, (double) result.items / seconds,
+                 (double) result.bytes / seconds, result.keys, result.memory_bytes, last ? "" : ",");
+}
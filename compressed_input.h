@@ -0,0 +1,417 @@
+#ifndef TRANSPCFG_COMPRESSED_INPUT_H
+#define TRANSPCFG_COMPRESSED_INPUT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef TRANSPCFG_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TRANSPCFG_WITH_LZMA
+#include <lzma.h>
+#endif
+#ifdef TRANSPCFG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+
+enum Compression {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP = 1,
+    COMPRESSION_XZ = 2,
+    COMPRESSION_ZSTD = 3
+};
+
+/**
+ * the longest magic we look for
+ */
+const size_t COMPRESSION_MAGIC_SIZE = 6;
+
+/**
+ * tell the format from the first bytes of a file, whatever its name is
+ */
+inline Compression detect_compression(const unsigned char *p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (n >= 6 && memcmp(p, "\xfd" "7zXZ\x00", 6) == 0) {
+        return COMPRESSION_XZ;
+    }
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+inline const char *compression_name(Compression format) {
+    const char *names[] = {"plain", "gzip", "xz", "zstd"};
+    return names[format];
+}
+
+/**
+ * whether this build can read the format (see TRANSPCFG_WITH_* in CMakeLists.txt)
+ */
+inline bool compression_supported(Compression format) {
+    switch (format) {
+        case COMPRESSION_NONE:
+            return true;
+#ifdef TRANSPCFG_WITH_ZLIB
+        case COMPRESSION_GZIP:
+            return true;
+#endif
+#ifdef TRANSPCFG_WITH_LZMA
+        case COMPRESSION_XZ:
+            return true;
+#endif
+#ifdef TRANSPCFG_WITH_ZSTD
+        case COMPRESSION_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * lock-free ring of bytes for exactly one writer thread and one reader thread.
+ * written and taken only ever grow, each side owns one of them and reads the other.
+ * it does not wait, a side that finds it full or empty has to wait on its own (see Decompressor).
+ * for example,
+ * ByteRing ring(1 << 20);
+ * ring.write("abc", 3);    // writer thread, 3
+ * ring.read(buf, 16);      // reader thread, 3
+ */
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        bytes.resize(size);
+        mask = size - 1;
+    }
+
+    /**
+     * copy as much of data as fits, the number of bytes copied
+     */
+    size_t write(const char *data, size_t size) {
+        size_t head = written.load(std::memory_order_relaxed);
+        size_t free = bytes.size() - (head - taken.load(std::memory_order_acquire));
+        size = size < free ? size : free;
+        copy_in(head & mask, data, size);
+        written.store(head + size, std::memory_order_release);
+        return size;
+    }
+
+    /**
+     * take up to size bytes, the number of bytes taken
+     */
+    size_t read(char *data, size_t size) {
+        size_t tail = taken.load(std::memory_order_relaxed);
+        size_t ready = written.load(std::memory_order_acquire) - tail;
+        size = size < ready ? size : ready;
+        copy_out(tail & mask, data, size);
+        taken.store(tail + size, std::memory_order_release);
+        return size;
+    }
+
+    /**
+     * bytes the reader could take now
+     */
+    size_t readable() const {
+        return written.load(std::memory_order_acquire) - taken.load(std::memory_order_acquire);
+    }
+
+    /**
+     * bytes the writer could copy in now
+     */
+    size_t writable() const {
+        return bytes.size() - readable();
+    }
+
+private:
+    void copy_in(size_t at, const char *data, size_t size) {
+        size_t first = size < bytes.size() - at ? size : bytes.size() - at;
+        memcpy(&bytes[at], data, first);
+        memcpy(&bytes[0], data + first, size - first);
+    }
+
+    void copy_out(size_t at, char *data, size_t size) const {
+        size_t first = size < bytes.size() - at ? size : bytes.size() - at;
+        memcpy(data, &bytes[at], first);
+        memcpy(data + first, &bytes[0], size - first);
+    }
+
+    std::vector<char> bytes;
+    size_t mask;
+    std::atomic<size_t> written{0};
+    std::atomic<size_t> taken{0};
+};
+
+/**
+ * decompresses a file on a thread of its own into a ByteRing, so that the reader parses
+ * one block while the next one is decompressed. a side that has to wait for the other one sleeps,
+ * the lock is only taken when one does. concatenated streams (pigz, pixz, zstd -T) are read
+ * to their end. a corrupt or truncated input ends the data early and sets failed().
+ * for example,
+ * Decompressor gz;
+ * gz.start(file, COMPRESSION_GZIP, magic, 6);  // the bytes that were already read from file
+ * while ((n = gz.read(buf, sizeof(buf))) > 0) use(buf, n);
+ */
+class Decompressor {
+public:
+    static const size_t RING_SIZE = 8u << 20u;
+    static const size_t CHUNK_SIZE = 256u << 10u;
+
+    Decompressor() : ring(RING_SIZE) {
+    }
+
+    ~Decompressor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    Decompressor(const Decompressor &) = delete;
+
+    Decompressor &operator=(const Decompressor &) = delete;
+
+    /**
+     * start decompressing file, prefix holds the bytes already read from it. file is not closed here.
+     */
+    void start(std::FILE *file, Compression format, const char *prefix, size_t prefix_size) {
+        input = file;
+        pending.assign(prefix, prefix + prefix_size);
+        worker = std::thread([this, format]() {
+            bool ok = false;
+            if (format == COMPRESSION_GZIP) {
+                ok = run_gzip();
+            } else if (format == COMPRESSION_XZ) {
+                ok = run_xz();
+            } else if (format == COMPRESSION_ZSTD) {
+                ok = run_zstd();
+            }
+            broken = !ok && !stop;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.store(true, std::memory_order_release);
+            }
+            changed.notify_all();
+        });
+    }
+
+    /**
+     * fill data with up to size bytes, fewer only at the end. 0 at the end.
+     */
+    size_t read(char *data, size_t size) {
+        size_t got = 0;
+        while (got < size) {
+            size_t n = ring.read(data + got, size - got);
+            got += n;
+            if (n > 0) {
+                wake(worker_waiting);
+                continue;
+            }
+            // everything was pushed before done was set
+            if (done.load(std::memory_order_acquire) && ring.readable() == 0) {
+                break;
+            }
+            sleep_until(reader_waiting, [this]() { return ring.readable() > 0 || done; });
+        }
+        return got;
+    }
+
+    bool failed() const {
+        return broken;
+    }
+
+private:
+    /**
+     * the next compressed bytes, 0 at the end of the file
+     */
+    size_t fill(std::vector<char> &in) {
+        if (!pending.empty()) {
+            size_t n = pending.size();
+            memcpy(in.data(), pending.data(), n);
+            pending.clear();
+            return n;
+        }
+        return std::fread(in.data(), 1, in.size(), input);
+    }
+
+    /**
+     * hand decompressed bytes to the reader, waiting while the ring is full
+     */
+    void push(const char *data, size_t size) {
+        while (size > 0 && !stop) {
+            size_t n = ring.write(data, size);
+            data += n;
+            size -= n;
+            if (n > 0) {
+                wake(reader_waiting);
+                continue;
+            }
+            sleep_until(worker_waiting, [this]() { return ring.writable() > 0 || stop; });
+        }
+    }
+
+    /**
+     * sleep until ready() holds. waiting is set before ready() is checked, so the other side either
+     * sees it after changing the ring or changed the ring before the check
+     */
+    template<typename Ready>
+    void sleep_until(std::atomic<bool> &waiting, const Ready &ready) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        changed.wait(lock, ready);
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * tell the other side that the ring changed, only if it sleeps or is about to.
+     * the lock makes sure it is either still checking or waiting
+     */
+    void wake(std::atomic<bool> &waiting) {
+        // orders the change of the ring before the look at waiting, pairs with the fence in sleep_until
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!waiting.load(std::memory_order_relaxed)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        changed.notify_all();
+    }
+
+    bool run_gzip() {
+#ifdef TRANSPCFG_WITH_ZLIB
+        std::vector<char> in(CHUNK_SIZE), out(CHUNK_SIZE);
+        z_stream z{};
+        // 15 + 32: the largest window, gzip or zlib header
+        if (inflateInit2(&z, 15 + 32) != Z_OK) {
+            return false;
+        }
+        bool ok = true, ended = false;
+        size_t n;
+        while (ok && !stop && (n = fill(in)) > 0) {
+            z.next_in = (Bytef *) in.data();
+            z.avail_in = (uInt) n;
+            bool more = true;
+            while (ok && !stop && more) {
+                if (ended) {
+                    if (z.avail_in == 0) {
+                        break;
+                    }
+                    // the next member of a concatenated file
+                    inflateReset(&z);
+                    ended = false;
+                }
+                z.next_out = (Bytef *) out.data();
+                z.avail_out = (uInt) out.size();
+                int result = inflate(&z, Z_NO_FLUSH);
+                size_t produced = out.size() - z.avail_out;
+                if (result == Z_BUF_ERROR && produced == 0) {
+                    // needs more input
+                    break;
+                }
+                ended = result == Z_STREAM_END;
+                ok = result == Z_OK || ended;
+                push(out.data(), produced);
+                more = z.avail_in > 0 || z.avail_out == 0;
+            }
+        }
+        inflateEnd(&z);
+        return ok && ended && !std::ferror(input);
+#else
+        return false;
+#endif
+    }
+
+    bool run_xz() {
+#ifdef TRANSPCFG_WITH_LZMA
+        std::vector<char> in(CHUNK_SIZE), out(CHUNK_SIZE);
+        lzma_stream xz = LZMA_STREAM_INIT;
+        if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+            return false;
+        }
+        lzma_action action = LZMA_RUN;
+        lzma_ret result = LZMA_OK;
+        while (!stop && result == LZMA_OK) {
+            if (xz.avail_in == 0 && action == LZMA_RUN) {
+                size_t n = fill(in);
+                xz.next_in = (const uint8_t *) in.data();
+                xz.avail_in = n;
+                if (n == 0) {
+                    action = LZMA_FINISH;
+                }
+            }
+            xz.next_out = (uint8_t *) out.data();
+            xz.avail_out = out.size();
+            result = lzma_code(&xz, action);
+            push(out.data(), out.size() - xz.avail_out);
+        }
+        lzma_end(&xz);
+        return result == LZMA_STREAM_END && !std::ferror(input);
+#else
+        return false;
+#endif
+    }
+
+    bool run_zstd() {
+#ifdef TRANSPCFG_WITH_ZSTD
+        std::vector<char> in(CHUNK_SIZE), out(CHUNK_SIZE);
+        ZSTD_DStream *zstd = ZSTD_createDStream();
+        if (zstd == nullptr) {
+            return false;
+        }
+        ZSTD_initDStream(zstd);
+        // 0 once a frame is complete, the hint for the next read otherwise
+        size_t left = 1;
+        bool ok = true;
+        size_t n;
+        while (ok && !stop && (n = fill(in)) > 0) {
+            ZSTD_inBuffer source{in.data(), n, 0};
+            bool full = true;
+            while (ok && !stop && (source.pos < source.size || full)) {
+                ZSTD_outBuffer target{out.data(), out.size(), 0};
+                left = ZSTD_decompressStream(zstd, &target, &source);
+                ok = !ZSTD_isError(left);
+                full = target.pos == target.size;
+                push(out.data(), ok ? target.pos : 0);
+            }
+        }
+        ZSTD_freeDStream(zstd);
+        return ok && left == 0 && !std::ferror(input);
+#else
+        return false;
+#endif
+    }
+
+    ByteRing ring;
+    std::FILE *input = nullptr;
+    std::vector<char> pending;
+    std::thread worker;
+    // the reader waits here while the ring is empty, the worker while it is full
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::atomic<bool> reader_waiting{false};
+    std::atomic<bool> worker_waiting{false};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> done{false};
+    std::atomic<bool> broken{false};
+};
+
+#endif //TRANSPCFG_COMPRESSED_INPUT_H
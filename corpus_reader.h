@@ -0,0 +1,224 @@
+#ifndef TRANSPCFG_CORPUS_READER_H
+#define TRANSPCFG_CORPUS_READER_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compressed_input.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+
+/**
+ * read a corpus exactly once, handing out blocks made of complete lines.
+ * regular files are memory mapped and come out as a single block,
+ * anything else (pipes, /dev/stdin, ...) is read in large blocks.
+ * gzip, xz and zstd input is recognized by its first bytes and decompressed on a background thread.
+ * for example,
+ * CorpusReader reader;
+ * if (reader.open("rockyou.txt")) reader.for_each_line([](const char *line, int size) { ... });
+ */
+class CorpusReader {
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 16u << 20u;
+
+    explicit CorpusReader(size_t block_size = DEFAULT_BLOCK_SIZE) : block_size(block_size) {
+    }
+
+    ~CorpusReader() {
+        close();
+    }
+
+    CorpusReader(const CorpusReader &) = delete;
+
+    CorpusReader &operator=(const CorpusReader &) = delete;
+
+    bool open(const char *path) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            map_size = (size_t) st.st_size;
+            if (map_size > 0) {
+                void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    madvise(addr, map_size, MADV_SEQUENTIAL);
+                    map = (const char *) addr;
+                }
+            }
+            if (map != nullptr && detect_compression((const unsigned char *) map, map_size) != COMPRESSION_NONE) {
+                // compressed, read it as a stream instead
+                munmap((void *) map, map_size);
+                map = nullptr;
+            } else if (map != nullptr || map_size == 0) {
+                ::close(fd);
+                mapped = true;
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        file = std::fopen(path, "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        buffer.resize(block_size);
+        size_t n = std::fread(&buffer[0], 1, COMPRESSION_MAGIC_SIZE, file);
+        format = detect_compression((const unsigned char *) &buffer[0], n);
+        if (format == COMPRESSION_NONE) {
+            carry = n;
+            return true;
+        }
+        if (!compression_supported(format)) {
+            return false;
+        }
+        decompressor = new Decompressor();
+        decompressor->start(file, format, &buffer[0], n);
+        return true;
+    }
+
+    void close() {
+        // stop the decompression before its input goes away
+        delete decompressor;
+        decompressor = nullptr;
+#ifndef _WIN32
+        if (map != nullptr) {
+            munmap((void *) map, map_size);
+        }
+#endif
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+        map = nullptr;
+        map_size = 0;
+        mapped = false;
+        handed_out = false;
+        file = nullptr;
+        format = COMPRESSION_NONE;
+        tail_offset = 0;
+        carry = 0;
+        std::vector<char>().swap(buffer);
+    }
+
+    bool is_mapped() const {
+        return mapped;
+    }
+
+    /**
+     * the format of the input, set even if open() failed because this build cannot read it
+     */
+    Compression compression() const {
+        return format;
+    }
+
+    /**
+     * true if the compressed input was corrupt or cut off, the lines up to that point have been handed out
+     */
+    bool failed() const {
+        return decompressor != nullptr && decompressor->failed();
+    }
+
+    /**
+     * the next block of complete lines, [begin, end). end is just behind a '\n',
+     * or the end of the input if the last line is not terminated.
+     * a block stays valid until the next call (for mapped files: until close()).
+     */
+    bool next_block(const char *&begin, const char *&end) {
+        if (mapped) {
+            if (handed_out || map_size == 0) {
+                return false;
+            }
+            handed_out = true;
+            begin = map;
+            end = map + map_size;
+            return true;
+        }
+        if (file == nullptr) {
+            return false;
+        }
+        // move the partial line left over from the previous block to the front
+        if (carry > 0 && tail_offset > 0) {
+            memmove(&buffer[0], &buffer[tail_offset], carry);
+        }
+        tail_offset = 0;
+        while (true) {
+            size_t n = decompressor != nullptr ? decompressor->read(&buffer[carry], buffer.size() - carry)
+                                               : std::fread(&buffer[carry], 1, buffer.size() - carry, file);
+            size_t filled = carry + n;
+            if (n == 0) {
+                // end of input, the rest is the last (unterminated) line
+                carry = 0;
+                if (filled == 0) {
+                    return false;
+                }
+                begin = &buffer[0];
+                end = begin + filled;
+                return true;
+            }
+            size_t last = filled;
+            while (last > 0 && buffer[last - 1] != '\n') {
+                last--;
+            }
+            if (last == 0) {
+                // a single line larger than the whole buffer
+                carry = filled;
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+            begin = &buffer[0];
+            end = begin + last;
+            tail_offset = last;
+            carry = filled - last;
+            return true;
+        }
+    }
+
+    /**
+     * call on_line(const char *line, int size) for every line of [begin, end), '\n' excluded
+     */
+    template<class F>
+    static void split_lines(const char *begin, const char *end, F &&on_line) {
+        const char *p = begin;
+        while (p < end) {
+            auto *nl = (const char *) memchr(p, '\n', end - p);
+            if (nl == nullptr) {
+                on_line(p, (int) (end - p));
+                break;
+            }
+            on_line(p, (int) (nl - p));
+            p = nl + 1;
+        }
+    }
+
+    template<class F>
+    void for_each_line(F &&on_line) {
+        const char *begin, *end;
+        while (next_block(begin, end)) {
+            split_lines(begin, end, on_line);
+        }
+    }
+
+private:
+    size_t block_size;
+    const char *map = nullptr;
+    size_t map_size = 0;
+    bool mapped = false;
+    bool handed_out = false;
+    std::FILE *file = nullptr;
+    Compression format = COMPRESSION_NONE;
+    Decompressor *decompressor = nullptr;
+    std::vector<char> buffer;
+    size_t tail_offset = 0;
+    size_t carry = 0;
+};
+
+#endif //TRANSPCFG_CORPUS_READER_H
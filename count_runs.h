@@ -0,0 +1,405 @@
+#ifndef TRANSPCFG_COUNT_RUNS_H
+#define TRANSPCFG_COUNT_RUNS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+#include "count_table.h"
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+
+/**
+ * fseek and ftell with 64-bit offsets, a run or counts.bin can pass 2 GiB where long has 32 bits (Windows)
+ */
+inline bool seek_file(std::FILE *file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (int64_t) offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+/**
+ * -1 if the position is unknown
+ */
+inline int64_t tell_file(std::FILE *file) {
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return (int64_t) ftello(file);
+#endif
+}
+
+/**
+ * reads a table written by write_count_table whose keys are sorted (a run), entry by entry.
+ * the table may start anywhere in the file. a run that is not sorted counts as broken.
+ * a sorted CountTable in memory can be read the same way.
+ * for example,
+ * CountRunReader run;
+ * if (run.open("run-0.bin")) while (run.next()) use(run.key(), run.size(), run.count());
+ */
+class CountRunReader {
+public:
+    static const size_t BUFFER_SIZE = 1u << 20u;
+
+    CountRunReader() = default;
+
+    ~CountRunReader() {
+        close();
+    }
+
+    CountRunReader(const CountRunReader &) = delete;
+
+    CountRunReader &operator=(const CountRunReader &) = delete;
+
+    bool open(const std::string &path, uint64_t offset = 0) {
+        close();
+        file = std::fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        buffer.resize(BUFFER_SIZE);
+        setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+        broken = !seek_file(file, offset) || std::fread(&left, sizeof(left), 1, file) != 1;
+        started = false;
+        return !broken;
+    }
+
+    /**
+     * the table has to be sorted and must not change while it is read
+     */
+    bool open(const CountTable &table) {
+        close();
+        entry = table.entries().data();
+        left = table.size();
+        broken = false;
+        return true;
+    }
+
+    void close() {
+        if (file != nullptr) {
+            std::fclose(file);
+            file = nullptr;
+        }
+        entry = nullptr;
+        left = 0;
+    }
+
+    /**
+     * go to the next entry, false at the end of the run or if it is broken
+     */
+    bool next() {
+        if (entry != nullptr && left > 0) {
+            current.assign(entry->key, entry->size);
+            value = entry->count;
+            entry++;
+            left--;
+            return true;
+        }
+        if (file == nullptr || broken || left == 0) {
+            return false;
+        }
+        uint32_t size;
+        int64_t count;
+        if (std::fread(&size, sizeof(size), 1, file) != 1 || std::fread(&count, sizeof(count), 1, file) != 1) {
+            broken = true;
+            return false;
+        }
+        previous.swap(current);
+        current.resize(size);
+        if (size > 0 && std::fread(&current[0], size, 1, file) != 1) {
+            broken = true;
+            return false;
+        }
+        if (started && !key_less(previous.data(), previous.size(), current.data(), current.size())) {
+            broken = true;
+            return false;
+        }
+        started = true;
+        value = count;
+        left--;
+        return true;
+    }
+
+    bool failed() const {
+        return broken;
+    }
+
+    const char *key() const {
+        return current.data();
+    }
+
+    uint32_t size() const {
+        return (uint32_t) current.size();
+    }
+
+    long long count() const {
+        return value;
+    }
+
+private:
+    std::FILE *file = nullptr;
+    const CountEntry *entry = nullptr;
+    std::vector<char> buffer;
+    std::string current;
+    std::string previous;
+    uint64_t left = 0;
+    long long value = 0;
+    bool started = false;
+    bool broken = false;
+};
+
+/**
+ * k-way merge of sorted runs on disk and sorted CountTables in memory.
+ * the keys come out in key order, the counts of a key in several sources are summed.
+ * for example,
+ * CountMerger digits;
+ * digits.add_table(digit_map);   // after digit_map.sort()
+ * digits.add_run("run-0.bin");
+ * while (digits.next()) use(digits.key(), digits.size(), digits.count());
+ */
+class CountMerger {
+public:
+    CountMerger() = default;
+
+    CountMerger(const CountMerger &) = delete;
+
+    CountMerger &operator=(const CountMerger &) = delete;
+
+    ~CountMerger() {
+        for (Source *source : sources) {
+            delete source;
+        }
+    }
+
+    bool add_run(const std::string &path, uint64_t offset = 0) {
+        auto *source = new Source();
+        source->run = new CountRunReader();
+        sources.push_back(source);
+        if (!source->run->open(path, offset)) {
+            broken = true;
+            return false;
+        }
+        advance(sources.size() - 1);
+        return true;
+    }
+
+    /**
+     * the table has to be sorted and must not change while it is merged
+     */
+    void add_table(const CountTable &table) {
+        auto *source = new Source();
+        source->entry = table.entries().data();
+        source->end = source->entry + table.size();
+        sources.push_back(source);
+        advance(sources.size() - 1);
+    }
+
+    /**
+     * go to the next key, false at the end or if a run is broken
+     */
+    bool next() {
+        if (heap.empty() || broken) {
+            return false;
+        }
+        size_t first = heap.top();
+        heap.pop();
+        current.assign(sources[first]->key, sources[first]->size);
+        value = sources[first]->count;
+        advance(first);
+        while (!heap.empty()) {
+            const Source *top = sources[heap.top()];
+            if (top->size != current.size() || memcmp(top->key, current.data(), current.size()) != 0) {
+                break;
+            }
+            size_t same = heap.top();
+            heap.pop();
+            value += top->count;
+            advance(same);
+        }
+        return !broken;
+    }
+
+    bool failed() const {
+        return broken;
+    }
+
+    const char *key() const {
+        return current.data();
+    }
+
+    uint32_t size() const {
+        return (uint32_t) current.size();
+    }
+
+    long long count() const {
+        return value;
+    }
+
+private:
+    struct Source {
+        CountRunReader *run = nullptr;
+        const CountEntry *entry = nullptr;
+        const CountEntry *end = nullptr;
+        const char *key = nullptr;
+        uint32_t size = 0;
+        long long count = 0;
+
+        ~Source() {
+            delete run;
+        }
+    };
+
+    struct Greater {
+        const std::vector<Source *> *sources;
+
+        bool operator()(size_t a, size_t b) const {
+            const Source *x = (*sources)[a], *y = (*sources)[b];
+            return key_less(y->key, y->size, x->key, x->size);
+        }
+    };
+
+    /**
+     * load the next entry of a source and put it back into the heap
+     */
+    void advance(size_t i) {
+        Source *source = sources[i];
+        if (source->run != nullptr) {
+            if (!source->run->next()) {
+                broken = broken || source->run->failed();
+                return;
+            }
+            source->key = source->run->key();
+            source->size = source->run->size();
+            source->count = source->run->count();
+        } else {
+            if (source->entry == source->end) {
+                return;
+            }
+            source->key = source->entry->key;
+            source->size = source->entry->size;
+            source->count = source->entry->count;
+            source->entry++;
+        }
+        heap.push(i);
+    }
+
+    std::vector<Source *> sources;
+    std::priority_queue<size_t, std::vector<size_t>, Greater> heap{Greater{&sources}};
+    std::string current;
+    long long value = 0;
+    bool broken = false;
+};
+
+/**
+ * walks several sorted runs side by side, one key at a time, telling which of them have it.
+ * unlike CountMerger the counts are not summed, each run keeps its own.
+ * for example,
+ * RunJoin join({&long_digits, &short_digits});   // opened, not started
+ * while (join.next()) if (join.has(1)) use(join.key(), join.size(), join.count(1));
+ */
+class RunJoin {
+public:
+    explicit RunJoin(std::vector<CountRunReader *> runs) : runs(std::move(runs)) {
+        for (CountRunReader *run : this->runs) {
+            ready.push_back(run->next());
+            matched.push_back(false);
+        }
+    }
+
+    /**
+     * go to the next key of any run, false at the end or if a run is broken
+     */
+    bool next() {
+        first = runs.size();
+        for (size_t r = 0; r < runs.size(); r++) {
+            if (matched[r]) {
+                ready[r] = runs[r]->next();
+                matched[r] = false;
+            }
+            if (ready[r] && (first == runs.size() || key_less(runs[r]->key(), runs[r]->size(),
+                                                               runs[first]->key(), runs[first]->size()))) {
+                first = r;
+            }
+        }
+        if (first == runs.size() || failed()) {
+            return false;
+        }
+        for (size_t r = first; r < runs.size(); r++) {
+            matched[r] = ready[r] && runs[r]->size() == size()
+                         && memcmp(runs[r]->key(), key(), size()) == 0;
+        }
+        return true;
+    }
+
+    bool failed() const {
+        for (CountRunReader *run : runs) {
+            if (run->failed()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char *key() const {
+        return runs[first]->key();
+    }
+
+    uint32_t size() const {
+        return runs[first]->size();
+    }
+
+    /**
+     * whether run r has the current key
+     */
+    bool has(size_t r) const {
+        return matched[r];
+    }
+
+    long long count(size_t r) const {
+        return runs[r]->count();
+    }
+
+private:
+    std::vector<CountRunReader *> runs;
+    std::vector<bool> ready;
+    std::vector<bool> matched;
+    size_t first = 0;
+};
+
+/**
+ * write the merged entries as one table (see write_count_table), the file has to be seekable
+ * since the number of entries is only known at the end. entries (if given) gets that number.
+ */
+inline bool write_count_run(std::FILE *file, CountMerger &merger, uint64_t *entries = nullptr) {
+    int64_t start = tell_file(file);
+    uint64_t n = 0;
+    if (start < 0 || std::fwrite(&n, sizeof(n), 1, file) != 1) {
+        return false;
+    }
+    while (merger.next()) {
+        uint32_t size = merger.size();
+        int64_t count = merger.count();
+        if (std::fwrite(&size, sizeof(size), 1, file) != 1 || std::fwrite(&count, sizeof(count), 1, file) != 1
+            || (size > 0 && std::fwrite(merger.key(), size, 1, file) != 1)) {
+            return false;
+        }
+        n++;
+    }
+    int64_t end = tell_file(file);
+    if (entries != nullptr) {
+        *entries = n;
+    }
+    return !merger.failed() && end >= 0
+           && seek_file(file, (uint64_t) start) && std::fwrite(&n, sizeof(n), 1, file) == 1
+           && seek_file(file, (uint64_t) end);
+}
+
+#endif //TRANSPCFG_COUNT_RUNS_H
@@ -0,0 +1,452 @@
+#ifndef TRANSPCFG_COUNT_TABLE_H
+#define TRANSPCFG_COUNT_TABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+/**
+ * 64-bit MurmurHash64A, the tail is read with a single memcpy
+ */
+inline uint64_t hash_bytes(const char *p, size_t n) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const unsigned r = 47;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (n * m);
+    while (n >= 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        p += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        uint64_t k = 0;
+        memcpy(&k, p, n);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/**
+ * keys are only ever appended, so a bump allocator hands out stable pointers
+ * without a heap allocation per key.
+ */
+class StringArena {
+public:
+    static const size_t CHUNK_SIZE = 1u << 20u;
+
+    StringArena() = default;
+
+    ~StringArena() {
+        clear();
+    }
+
+    StringArena(const StringArena &) = delete;
+
+    StringArena &operator=(const StringArena &) = delete;
+
+    StringArena(StringArena &&other) noexcept {
+        swap(other);
+    }
+
+    StringArena &operator=(StringArena &&other) noexcept {
+        clear();
+        swap(other);
+        return *this;
+    }
+
+    const char *intern(const char *s, size_t n) {
+        if (n > left || cursor == nullptr) {
+            size_t chunk = n > CHUNK_SIZE / 4 ? n : CHUNK_SIZE;
+            cursor = (char *) std::malloc(chunk == 0 ? 1 : chunk);
+            chunks.push_back(cursor);
+            left = chunk;
+            reserved += chunk;
+        }
+        char *p = cursor;
+        memcpy(p, s, n);
+        cursor += n;
+        left -= n;
+        return p;
+    }
+
+    /**
+     * take over the chunks of other, pointers into them stay valid
+     */
+    void adopt(StringArena &other) {
+        chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+        reserved += other.reserved;
+        other.chunks.clear();
+        other.reserved = 0;
+        other.cursor = nullptr;
+        other.left = 0;
+    }
+
+    void clear() {
+        for (char *chunk : chunks) {
+            std::free(chunk);
+        }
+        chunks.clear();
+        cursor = nullptr;
+        left = 0;
+        reserved = 0;
+    }
+
+    size_t memory_bytes() const {
+        return reserved;
+    }
+
+    void swap(StringArena &other) {
+        chunks.swap(other.chunks);
+        std::swap(cursor, other.cursor);
+        std::swap(left, other.left);
+        std::swap(reserved, other.reserved);
+    }
+
+private:
+    std::vector<char *> chunks;
+    char *cursor = nullptr;
+    size_t left = 0;
+    size_t reserved = 0;
+};
+
+/**
+ * a key and its count, as kept by CountTable
+ */
+struct CountEntry {
+    const char *key;
+    uint32_t size;
+    long long count;
+
+    std::string str() const {
+        return std::string(key, size);
+    }
+};
+
+/**
+ * the order of std::map<std::string, ...>: bytes compared unsigned, a prefix comes first
+ */
+inline bool key_less(const char *a, size_t na, const char *b, size_t nb) {
+    int c = memcmp(a, b, na < nb ? na : nb);
+    return c < 0 || (c == 0 && na < nb);
+}
+
+/**
+ * counts of strings in a flat open-addressing (linear probing) hash table.
+ * the entries are kept densely in insertion order, the probed index only holds
+ * 8-byte slots (entry number + upper half of the 64-bit hash as a tag), so probing
+ * rarely touches the keys and an empty slot costs 8 bytes. keys are interned in a StringArena.
+ * for example,
+ * CountTable digits;
+ * digits.add("123", 3);
+ * digits.sort();
+ * digits.entries();  // [("123", 1)]
+ */
+class CountTable {
+public:
+    CountTable() = default;
+
+    CountTable(const CountTable &) = delete;
+
+    CountTable &operator=(const CountTable &) = delete;
+
+    CountTable(CountTable &&other) noexcept {
+        swap(other);
+    }
+
+    CountTable &operator=(CountTable &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    /**
+     * count += delta, the key is copied into the arena the first time it is seen
+     * (or kept as it is with key views on)
+     */
+    void add(const char *key, size_t size, long long delta = 1) {
+        add_hashed(hash_bytes(key, size), key, size, delta, !views);
+    }
+
+    void add(const std::string &key, long long delta = 1) {
+        add(key.data(), key.size(), delta);
+    }
+
+    /**
+     * with views on, add() keeps the pointer to a new key instead of copying it, for keys that live in
+     * memory which outlasts the table, e.g. a mapped corpus
+     */
+    void key_views(bool on) {
+        views = on;
+    }
+
+    /**
+     * the count of key, nullptr if it was never added
+     */
+    const long long *find(const char *key, size_t size) const {
+        if (items.empty()) {
+            return nullptr;
+        }
+        uint64_t hash = hash_bytes(key, size);
+        uint64_t tag = hash & TAG_MASK;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            uint64_t slot = slots[i];
+            if (slot == 0) {
+                return nullptr;
+            }
+            if ((slot & TAG_MASK) == tag) {
+                const CountEntry &entry = items[(slot & ~TAG_MASK) - 1];
+                if (entry.size == size && memcmp(entry.key, key, size) == 0) {
+                    return &entry.count;
+                }
+            }
+        }
+    }
+
+    const long long *find(const std::string &key) const {
+        return find(key.data(), key.size());
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    bool empty() const {
+        return items.empty();
+    }
+
+    /**
+     * add all counts of other to this table, other is left empty.
+     * its keys are taken over together with its arena, nothing is copied.
+     */
+    void merge(CountTable &other) {
+        if (other.items.size() > items.size()) {
+            swap(other);
+        }
+        arena.adopt(other.arena);
+        for (const CountEntry &entry : other.items) {
+            add_hashed(hash_bytes(entry.key, entry.size), entry.key, entry.size, entry.count, false);
+        }
+        other.clear();
+    }
+
+    /**
+     * the entries, in insertion order or in key order after sort()
+     */
+    const std::vector<CountEntry> &entries() const {
+        return items;
+    }
+
+    /**
+     * put the entries in the order std::map<std::string, ...> would keep them.
+     * done in place, only the index is rebuilt.
+     */
+    void sort() {
+        std::sort(items.begin(), items.end(), [](const CountEntry &a, const CountEntry &b) {
+            return key_less(a.key, a.size, b.key, b.size);
+        });
+        rebuild(slots.size());
+    }
+
+    void clear() {
+        std::vector<CountEntry>().swap(items);
+        std::vector<uint64_t>().swap(slots);
+        arena.clear();
+        mask = 0;
+    }
+
+    /**
+     * bytes held by the entries, the index and the interned keys
+     */
+    size_t memory_bytes() const {
+        return items.capacity() * sizeof(CountEntry) + slots.capacity() * sizeof(uint64_t) + arena.memory_bytes();
+    }
+
+    void swap(CountTable &other) {
+        items.swap(other.items);
+        slots.swap(other.slots);
+        arena.swap(other.arena);
+        std::swap(mask, other.mask);
+    }
+
+private:
+    static const uint64_t TAG_MASK = 0xffffffff00000000ULL;
+
+    void add_hashed(uint64_t hash, const char *key, size_t size, long long delta, bool intern) {
+        if ((items.size() + 1) * 10 > slots.size() * 7) {
+            rebuild(slots.empty() ? 1024 : slots.size() * 2);
+        }
+        uint64_t tag = hash & TAG_MASK;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            uint64_t slot = slots[i];
+            if (slot == 0) {
+                items.push_back(CountEntry{intern ? arena.intern(key, size) : key, (uint32_t) size, delta});
+                slots[i] = tag | items.size();
+                return;
+            }
+            if ((slot & TAG_MASK) == tag) {
+                CountEntry &entry = items[(slot & ~TAG_MASK) - 1];
+                if (entry.size == size && memcmp(entry.key, key, size) == 0) {
+                    entry.count += delta;
+                    return;
+                }
+            }
+        }
+    }
+
+    void rebuild(size_t capacity) {
+        std::vector<uint64_t>(capacity, 0).swap(slots);
+        mask = capacity - 1;
+        for (size_t n = 0; n < items.size(); n++) {
+            uint64_t hash = hash_bytes(items[n].key, items[n].size);
+            size_t i = hash & mask;
+            while (slots[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = (hash & TAG_MASK) | (n + 1);
+        }
+    }
+
+    std::vector<CountEntry> items;
+    std::vector<uint64_t> slots;
+    StringArena arena;
+    size_t mask = 0;
+    bool views = false;
+};
+
+/**
+ * a set of strings for when there is nothing to count, e.g. the words of a dictionary.
+ * the keys sit back to back in one pool, each behind its size (7 bits per byte), and a slot of the
+ * index is the position of its key in the pool plus a 24-bit tag of its hash, about 20 bytes less
+ * per key than a CountTable.
+ * for example,
+ * KeySet words;
+ * words.insert("password", 8);  // true
+ * words.insert("password", 8);  // false
+ */
+class KeySet {
+public:
+    KeySet() = default;
+
+    KeySet(const KeySet &) = delete;
+
+    KeySet &operator=(const KeySet &) = delete;
+
+    /**
+     * false if key was already in the set
+     */
+    bool insert(const char *key, size_t size) {
+        if ((count + 1) * 10 > slots.size() * 7) {
+            rebuild(slots.empty() ? 1024 : slots.size() * 2);
+        }
+        uint64_t hash = hash_bytes(key, size);
+        uint64_t tag = hash & TAG_MASK;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            uint64_t slot = slots[i];
+            if (slot == 0) {
+                slots[i] = tag | (pool.size() + 1);
+                for (size_t n = size; ; n >>= 7u) {
+                    pool.push_back((char) ((n & 0x7fu) | (n >= 0x80u ? 0x80u : 0u)));
+                    if (n < 0x80u) {
+                        break;
+                    }
+                }
+                pool.insert(pool.end(), key, key + size);
+                count++;
+                return true;
+            }
+            if ((slot & TAG_MASK) == tag) {
+                size_t key_size;
+                const char *stored = key_at((slot & ~TAG_MASK) - 1, key_size);
+                if (key_size == size && memcmp(stored, key, size) == 0) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void clear() {
+        std::vector<char>().swap(pool);
+        std::vector<uint64_t>().swap(slots);
+        mask = 0;
+        count = 0;
+    }
+
+    size_t memory_bytes() const {
+        return pool.capacity() + slots.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    static const uint64_t TAG_MASK = 0xffffff0000000000ULL;
+
+    const char *key_at(size_t offset, size_t &size) const {
+        size = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            auto byte = (unsigned char) pool[offset++];
+            size |= (size_t) (byte & 0x7fu) << shift;
+            if (byte < 0x80u) {
+                break;
+            }
+        }
+        return pool.data() + offset;
+    }
+
+    void rebuild(size_t capacity) {
+        std::vector<uint64_t>(capacity, 0).swap(slots);
+        mask = capacity - 1;
+        for (size_t offset = 0; offset < pool.size();) {
+            size_t size;
+            const char *key = key_at(offset, size);
+            uint64_t hash = hash_bytes(key, size);
+            size_t i = hash & mask;
+            while (slots[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = (hash & TAG_MASK) | (offset + 1);
+            offset = (size_t) (key - pool.data()) + size;
+        }
+    }
+
+    std::vector<char> pool;
+    std::vector<uint64_t> slots;
+    size_t mask = 0;
+    size_t count = 0;
+};
+
+/**
+ * a CountTable on disk, native byte order: a uint64_t number of entries,
+ * then per entry a uint32_t key size, an int64_t count and the key.
+ */
+inline bool write_count_table(std::FILE *file, const CountTable &table) {
+    uint64_t n = table.size();
+    if (std::fwrite(&n, sizeof(n), 1, file) != 1) {
+        return false;
+    }
+    for (const CountEntry &entry : table.entries()) {
+        int64_t count = entry.count;
+        if (std::fwrite(&entry.size, sizeof(entry.size), 1, file) != 1
+            || std::fwrite(&count, sizeof(count), 1, file) != 1
+            || (entry.size > 0 && std::fwrite(entry.key, entry.size, 1, file) != 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif //TRANSPCFG_COUNT_TABLE_H
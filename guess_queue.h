@@ -0,0 +1,416 @@
+#ifndef TRANSPCFG_GUESS_QUEUE_H
+#define TRANSPCFG_GUESS_QUEUE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <vector>
+#include "structure_key.h"
+#include "model_file.h"
+
+
+/**
+ * the pre-terminals of a model in the order guess makes its guesses: the most probable pre-terminal
+ * (a structure with one group of terminals per run) is popped, every combination of its groups' words is a
+ * guess, and the pre-terminals with one group from its pivot on replaced by the next one are pushed.
+ * guess and train --evaluate both enumerate through this class, so they make the same guesses.
+ * for example,
+ * GuessQueue queue;
+ * if (queue.load(model)) {
+ *     queue.for_each_guess(4, 16, [](const char *guess, size_t size) { return use(guess, size); });  // false stops
+ * }
+ */
+class GuessQueue {
+public:
+    /**
+     * runs of this length or longer are left out (MAXWORDSIZE of guess)
+     */
+    static const int MAX_RUN = 20;
+    static const uint32_t NONE = 0xffffffffu;
+    /**
+     * more combinations than any run can make, counts stop here
+     */
+    static const unsigned long long MAX_COMBINATIONS = 1ULL << 62;
+
+    /**
+     * equally probable terminals of one kind and length, word i is pool[offsets[i], offsets[i + 1])
+     */
+    struct Group {
+        double probability;
+        const char *pool;
+        uint64_t pool_size;
+        const uint64_t *offsets;
+        uint64_t word_count;
+        // the shortest and the longest word in bytes, set when the group is popped for the first time
+        size_t min_word_size;
+        size_t max_word_size;
+        // the next most probable group of the same kind and length, NONE for the last one
+        uint32_t next;
+        bool checked;
+    };
+
+    /**
+     * a popped pre-terminal, its combinations are numbered 0 to combinations - 1
+     */
+    struct PreTerminal {
+        std::vector<const Group *> groups;
+        // combinations that share one word of a section
+        std::vector<unsigned long long> spans;
+        unsigned long long combinations = 0;
+    };
+
+    /**
+     * the number of the new group. previous is the group before it in probability order, NONE for the first.
+     * the words are used in place, they have to outlive the queue. all groups are added before the first pop.
+     * the offsets are only read once a pre-terminal with the group is popped, a group that is never used costs
+     * nothing but its record
+     */
+    uint32_t add_group(double probability, const char *pool, uint64_t pool_size, const uint64_t *offsets,
+                       uint64_t word_count, uint32_t previous) {
+        Group group{probability, pool, pool_size, offsets, word_count, SIZE_MAX, 0, NONE, false};
+        auto id = (uint32_t) groups.size();
+        groups.push_back(group);
+        if (previous != NONE) {
+            groups[previous].next = id;
+        }
+        return id;
+    }
+
+    /**
+     * push a structure with the most probable group of each of its runs.
+     * one without groups is skipped, false if it has 0 probability or too many sections
+     */
+    bool add_structure(double probability, const uint32_t *replacement, size_t sections) {
+        if (sections == 0) { // nothing to replace, e.g. the structure of a non-ascii password
+            return true;
+        }
+        double start = probability;
+        for (size_t i = 0; i < sections; i++) {
+            probability *= groups[replacement[i]].probability;
+        }
+        if (probability == 0 || sections > UINT16_MAX) {
+            return false;
+        }
+        QueueItem item{probability, allocate_node((int) sections), 0, (uint16_t) sections};
+        uint32_t *node = node_slots(item.sections, item.node);
+        node[0] = (uint32_t) structure_probability.size();
+        std::copy(replacement, replacement + sections, node + 1);
+        structure_probability.push_back(start);
+        queue.push(item);
+        return true;
+    }
+
+    /**
+     * the groups and structures of model.bin, its words are used in place and checked as they are popped.
+     * false if a group or a structure points outside the file
+     */
+    bool load(const ModelFile &model) {
+        // by CharClass
+        ModelTerminalKind kinds[] = {MODEL_DIGITS, MODEL_LETTERS, MODEL_SPECIAL};
+        uint32_t first[3][MAX_RUN];
+        for (int cls = 0; cls < 3; cls++) {
+            for (int length = 0; length < MAX_RUN; length++) {
+                first[cls][length] = NONE;
+                uint32_t previous = NONE;
+                for (uint64_t g = 0; g < model.group_count(kinds[cls], length); g++) {
+                    const ModelGroup &group = model.group(kinds[cls], length, g);
+                    if (!model.valid_group(kinds[cls], group)) {
+                        return false;
+                    }
+                    previous = add_group(group.probability, model.word_pool(kinds[cls]),
+                                         model.word_pool_size(kinds[cls]),
+                                         model.word_offsets(kinds[cls]) + group.first_word, group.word_count,
+                                         previous);
+                    if (g == 0) {
+                        first[cls][length] = previous;
+                    }
+                }
+            }
+        }
+        std::vector<uint32_t> replacement;
+        for (uint64_t n = 0; n < model.structure_count(); n++) {
+            const ModelStructure &record = model.structure(n);
+            if (!model.valid_structure(record)) {
+                return false;
+            }
+            bool usable = true;
+            replacement.clear();
+            auto add_run = [&first, &usable, &replacement](int cls, int length) {
+                if (length >= MAX_RUN || first[cls][length] == NONE) {
+                    usable = false;
+                } else {
+                    replacement.push_back(first[cls][length]);
+                }
+            };
+            if (!for_each_structure_run(model.structure_key(record), record.key_size, add_run)) {
+                return false;
+            }
+            if (usable && !add_structure(record.probability, replacement.data(), replacement.size())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool empty() const {
+        return queue.empty();
+    }
+
+    /**
+     * a popped pre-terminal had a group whose words lie outside its pool, pop stopped there
+     */
+    bool failed() const {
+        return corrupt;
+    }
+
+    /**
+     * take the most probable pre-terminal, false once there is none or one of its groups is broken.
+     * the ones that follow it are pushed right away, they do not depend on its guesses
+     */
+    bool pop(PreTerminal &item) {
+        if (queue.empty()) {
+            return false;
+        }
+        QueueItem top = queue.top();
+        queue.pop();
+        // the node is free again once it is copied, the first new value pushed takes it
+        const uint32_t *node = node_slots(top.sections, top.node);
+        popped.assign(node, node + 1 + top.sections);
+        pools[top.sections].free_nodes.push_back(top.node);
+        push_next(top, popped.data());
+        item.groups.clear();
+        for (int i = 1; i <= top.sections; i++) {
+            if (!check_group(groups[popped[i]])) {
+                corrupt = true;
+                return false;
+            }
+            item.groups.push_back(&groups[popped[i]]);
+        }
+        item.combinations = count_combinations(item.groups, item.spans);
+        return true;
+    }
+
+    /**
+     * append the guesses of the combinations first to last - 1 of item to output, one per line.
+     * the sections before the last one turn like an odometer and only the words from the section that turned on
+     * are copied into the prefix again. then the words of the last section are copied behind the prefix in one go.
+     * a guess out of [min_len, max_len] ends the words of the last section
+     */
+    static void expand(const PreTerminal &item, unsigned long long first, unsigned long long last, long min_len,
+                       long max_len, std::string &output, unsigned long long &guesses) {
+        const std::vector<const Group *> &sections = item.groups;
+        int last_section = (int) sections.size() - 1;
+        const Group *last_group = sections[last_section];
+        static thread_local std::vector<uint64_t> word;
+        // the size of the guess before each section
+        static thread_local std::vector<size_t> prefix_size;
+        static thread_local std::string prefix;
+        word.assign(sections.size(), 0);
+        prefix_size.assign(sections.size(), 0);
+        prefix.clear();
+        // the words of the first combination
+        unsigned long long combination = first;
+        for (int i = 0; i <= last_section; i++) {
+            word[i] = combination / item.spans[i];
+            combination -= word[i] * item.spans[i];
+        }
+        // the first combination with the current prefix
+        combination = first - word[last_section];
+        int turned = 0;
+        while (true) {
+            for (int i = turned; i < last_section; i++) {
+                const Group *group = sections[i];
+                prefix.resize(prefix_size[i]);
+                const uint64_t *offsets = group->offsets + word[i];
+                prefix.append(group->pool + offsets[0], offsets[1] - offsets[0]);
+                prefix_size[i + 1] = prefix.size();
+            }
+            size_t size = prefix.size();
+            uint64_t end = std::min(last_group->word_count, (uint64_t) (last - combination));
+            // the words up to the first one out of the length bounds, all of them if even the extremes fit
+            uint64_t stop = end;
+            if ((long) (size + last_group->min_word_size) < min_len
+                || (long) (size + last_group->max_word_size) > max_len) {
+                for (stop = 0; stop < end; stop++) {
+                    auto guess_size = (long) (size + last_group->offsets[stop + 1] - last_group->offsets[stop]);
+                    if (guess_size < min_len || guess_size > max_len) {
+                        break;
+                    }
+                }
+            }
+            uint64_t start = word[last_section];
+            if (start < stop) {
+                const uint64_t *offsets = last_group->offsets;
+                size_t at = output.size();
+                output.resize(at + (stop - start) * (size + 1) + (offsets[stop] - offsets[start]));
+                char *out = &output[at];
+                for (uint64_t w = start; w < stop; w++) {
+                    auto word_size = (size_t) (offsets[w + 1] - offsets[w]);
+                    memcpy(out, prefix.data(), size);
+                    out += size;
+                    memcpy(out, last_group->pool + offsets[w], word_size);
+                    out += word_size;
+                    *out++ = '\n';
+                }
+                guesses += stop - start;
+            }
+            word[last_section] = 0;
+            // turn the odometer, the next prefix starts one span of the section before the last later
+            turned = last_section - 1;
+            while (turned >= 0 && ++word[turned] == sections[turned]->word_count) {
+                word[turned] = 0;
+                turned--;
+            }
+            if (turned < 0) {
+                return;
+            }
+            combination += item.spans[last_section - 1];
+            if (combination >= last) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * pop the pre-terminals and call visit(guess, size) for every guess until it returns false or there are
+     * no more, chunk combinations are expanded at a time. false if a broken group came up
+     */
+    template<typename Visit>
+    bool for_each_guess(long min_len, long max_len, const Visit &visit, unsigned long long chunk = 65536) {
+        PreTerminal item;
+        std::string output;
+        while (pop(item)) {
+            for (unsigned long long first = 0; first < item.combinations; first += chunk) {
+                output.clear();
+                unsigned long long guesses = 0;
+                expand(item, first, std::min(first + chunk, item.combinations), min_len, max_len, output, guesses);
+                for (size_t at = 0; at < output.size();) {
+                    size_t end = output.find('\n', at);
+                    if (!visit(output.data() + at, end - at)) {
+                        return true;
+                    }
+                    at = end + 1;
+                }
+            }
+        }
+        return !corrupt;
+    }
+
+private:
+    /**
+     * what the queue holds of a pre-terminal, its structure and groups are in a node of the pool of its size
+     */
+    struct QueueItem {
+        double probability;
+        uint32_t node;
+        uint16_t pivot;
+        uint16_t sections;
+    };
+
+    struct Order {
+        bool operator()(const QueueItem &lhs, const QueueItem &rhs) const {
+            return lhs.probability < rhs.probability;
+        }
+    };
+
+    /**
+     * the nodes of the pre-terminals with the same number of sections: the number of the structure, then the
+     * numbers of the groups. the node of a popped pre-terminal is taken by the next one that is pushed
+     */
+    struct NodePool {
+        std::vector<uint32_t> slots;
+        std::vector<uint32_t> free_nodes;
+    };
+
+    static unsigned long long count_combinations(const std::vector<const Group *> &sections,
+                                                 std::vector<unsigned long long> &spans) {
+        unsigned long long total = 1;
+        spans.assign(sections.size(), 1);
+        for (int i = (int) sections.size() - 1; i >= 0; i--) {
+            spans[i] = total;
+            unsigned long long words = sections[i]->word_count;
+            total = (words != 0 && total > MAX_COMBINATIONS / words) ? MAX_COMBINATIONS : total * words;
+        }
+        return total;
+    }
+
+    /**
+     * the first time a group is used: its words have to lie in its pool one after the other,
+     * then their shortest and longest size are known
+     */
+    static bool check_group(Group &group) {
+        if (group.checked) {
+            return true;
+        }
+        const uint64_t *offsets = group.offsets;
+        if (offsets[group.word_count] > group.pool_size) {
+            return false;
+        }
+        for (uint64_t w = 0; w < group.word_count; w++) {
+            if (offsets[w] > offsets[w + 1]) {
+                return false;
+            }
+            auto size = (size_t) (offsets[w + 1] - offsets[w]);
+            group.min_word_size = std::min(group.min_word_size, size);
+            group.max_word_size = std::max(group.max_word_size, size);
+        }
+        group.checked = true;
+        return true;
+    }
+
+    uint32_t allocate_node(int sections) {
+        if ((size_t) sections >= pools.size()) {
+            pools.resize(sections + 1);
+        }
+        NodePool &pool = pools[sections];
+        if (!pool.free_nodes.empty()) {
+            uint32_t node = pool.free_nodes.back();
+            pool.free_nodes.pop_back();
+            return node;
+        }
+        pool.slots.resize(pool.slots.size() + 1 + sections);
+        return (uint32_t) (pool.slots.size() / (1 + sections) - 1);
+    }
+
+    /**
+     * only valid until the next node is allocated
+     */
+    uint32_t *node_slots(int sections, uint32_t node) {
+        return &pools[sections].slots[(size_t) node * (1 + sections)];
+    }
+
+    /**
+     * the pre-terminals with one group from the pivot of item on replaced by its next one.
+     * node is a copy of item's node, the new nodes may take its place in the pool
+     */
+    void push_next(const QueueItem &item, const uint32_t *node) {
+        double start = structure_probability[node[0]];
+        const uint32_t *replacement = node + 1;
+        for (int i = item.pivot; i < item.sections; i++) {
+            if (groups[replacement[i]].next == NONE) {
+                continue;
+            }
+            QueueItem next{start, allocate_node(item.sections), (uint16_t) i, item.sections};
+            uint32_t *slots = node_slots(next.sections, next.node);
+            slots[0] = node[0];
+            for (int j = 0; j < item.sections; j++) {
+                slots[j + 1] = j != i ? replacement[j] : groups[replacement[j]].next;
+                next.probability *= groups[slots[j + 1]].probability;
+            }
+            queue.push(next);
+        }
+    }
+
+    std::vector<Group> groups;
+    // the probability of every structure without its groups
+    std::vector<double> structure_probability;
+    // by the number of sections
+    std::vector<NodePool> pools;
+    std::priority_queue<QueueItem, std::vector<QueueItem>, Order> queue;
+    std::vector<uint32_t> popped;
+    bool corrupt = false;
+};
+
+#endif //TRANSPCFG_GUESS_QUEUE_H
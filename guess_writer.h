@@ -0,0 +1,191 @@
+#ifndef TRANSPCFG_GUESS_WRITER_H
+#define TRANSPCFG_GUESS_WRITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#endif
+
+
+/**
+ * the guesses on their way to a file, stdout ("-") or a named pipe. they are copied into one of two large blocks,
+ * a full block is written by a background thread while the other one fills, so the guesses are made while the
+ * last ones are still being written. the bytes come out in the order they were handed in.
+ * for example,
+ * GuessWriter writer;
+ * if (writer.open("-")) { writer.write("123456\n", 7); writer.close(); }
+ */
+class GuessWriter {
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 4 << 20;
+
+    explicit GuessWriter(size_t block_size = DEFAULT_BLOCK_SIZE) : block_size(block_size) {
+    }
+
+    ~GuessWriter() {
+        close();
+    }
+
+    GuessWriter(const GuessWriter &) = delete;
+
+    GuessWriter &operator=(const GuessWriter &) = delete;
+
+    /**
+     * "-" is stdout, anything else is created or truncated. opening a named pipe waits for its reader
+     */
+    bool open(const std::string &path) {
+        close();
+#ifdef _WIN32
+        file = path == "-" ? stdout : std::fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+#else
+        fd = path == "-" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            return false;
+        }
+        owns_fd = fd != STDOUT_FILENO;
+        // a reader that goes away makes write fail instead of killing the process
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+        filling.reserve(block_size);
+        writing.reserve(block_size);
+        failed = false;
+        stopping = false;
+        busy = false;
+        writer = std::thread([this]() { run(); });
+        return true;
+    }
+
+    /**
+     * false once something could not be written, the rest is not worth making
+     */
+    bool write(const char *data, size_t size) {
+        while (size > 0) {
+            size_t n = std::min(size, block_size - filling.size());
+            filling.append(data, n);
+            data += n;
+            size -= n;
+            if (filling.size() == block_size && !hand_over()) {
+                return false;
+            }
+        }
+        return !failed;
+    }
+
+    /**
+     * write what is left and wait for it, false if not everything could be written
+     */
+    bool close() {
+        if (!writer.joinable()) {
+            return !failed;
+        }
+        if (!filling.empty()) {
+            hand_over();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+#ifdef _WIN32
+        if (std::fflush(file) != 0 || (file != stdout && std::fclose(file) != 0)) {
+            failed = true;
+        }
+        file = nullptr;
+#else
+        if (owns_fd && ::close(fd) != 0) {
+            failed = true;
+        }
+        fd = -1;
+        owns_fd = false;
+#endif
+        return !failed;
+    }
+
+private:
+    /**
+     * give the filled block to the background thread once it is done with the other one
+     */
+    bool hand_over() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return !busy; });
+        if (failed) {
+            return false;
+        }
+        std::swap(filling, writing);
+        filling.clear();
+        busy = true;
+        wake.notify_one();
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this]() { return busy || stopping; });
+            if (!busy) {
+                return;
+            }
+            lock.unlock();
+            bool written = write_all(writing.data(), writing.size());
+            lock.lock();
+            if (!written) {
+                failed = true;
+            }
+            busy = false;
+            idle.notify_one();
+        }
+    }
+
+    bool write_all(const char *data, size_t size) {
+#ifdef _WIN32
+        return std::fwrite(data, 1, size, file) == size;
+#else
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += n;
+            size -= (size_t) n;
+        }
+        return true;
+#endif
+    }
+
+    size_t block_size;
+    // filled by write(), written by the background thread while busy
+    std::string filling;
+    std::string writing;
+#ifdef _WIN32
+    std::FILE *file = nullptr;
+#else
+    int fd = -1;
+    bool owns_fd = false;
+#endif
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool busy = false;
+    bool stopping = false;
+    std::atomic<bool> failed{false};
+};
+
+#endif //TRANSPCFG_GUESS_WRITER_H
@@ -0,0 +1,353 @@
+#ifndef TRANSPCFG_HEAVY_HITTERS_H
+#define TRANSPCFG_HEAVY_HITTERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "count_table.h"
+
+
+/**
+ * Space-Saving (Metwally et al.): the approximate counts of the most frequent keys in a fixed number of counters.
+ * a new key takes over the counter with the smallest count and inherits that count as its error,
+ * so a count is never too small and too large by at most its error. every key that occurs more than
+ * total() / capacity times keeps its counter. until summaries are merged the counts add up to total().
+ * for example,
+ * SpaceSaving top(1000);
+ * top.add("123456", 6);
+ */
+class SpaceSaving {
+public:
+    struct Counter {
+        std::string key;
+        long long count;
+        long long error;
+        uint64_t hash;
+        uint32_t heap_pos;
+    };
+
+    explicit SpaceSaving(size_t capacity = 1024) : capacity(capacity < 1 ? 1 : capacity) {
+    }
+
+    void add(const char *key, size_t size, long long delta = 1) {
+        observed += delta;
+        uint64_t hash = hash_bytes(key, size);
+        uint32_t found = find(key, size, hash);
+        if (found != NONE) {
+            counters[found].count += delta;
+            sift_down(counters[found].heap_pos);
+            return;
+        }
+        if (counters.size() < capacity) {
+            counters.push_back(Counter{std::string(key, size), delta, 0, hash, (uint32_t) heap.size()});
+            heap.push_back((uint32_t) counters.size() - 1);
+            sift_up(heap.size() - 1);
+            insert(hash, (uint32_t) counters.size() - 1);
+            return;
+        }
+        // take over the smallest counter
+        uint32_t victim = heap[0];
+        Counter &counter = counters[victim];
+        erase(counter.hash, victim);
+        counter.key.assign(key, size);
+        counter.hash = hash;
+        counter.error = counter.count;
+        counter.count += delta;
+        insert(hash, victim);
+        sift_down(0);
+    }
+
+    /**
+     * add the counters of other (Agarwal et al., mergeable summaries): counts of the same key are added,
+     * a key missing in one summary may have had up to its min_count() there, so that much is added to its
+     * count and to its error. the largest counters are kept.
+     */
+    void merge(const SpaceSaving &other) {
+        if (other.counters.empty()) {
+            return;
+        }
+        long long own_min = min_count(), other_min = other.min_count();
+        std::vector<Counter> all;
+        all.reserve(counters.size() + other.counters.size());
+        for (const Counter &counter : counters) {
+            all.push_back(counter);
+            all.back().count += other_min;
+            all.back().error += other_min;
+        }
+        for (const Counter &counter : other.counters) {
+            uint32_t found = find(counter.key.data(), counter.key.size(), counter.hash);
+            if (found != NONE) {
+                all[found].count += counter.count - other_min;
+                all[found].error += counter.error - other_min;
+            } else {
+                all.push_back(counter);
+                all.back().count += own_min;
+                all.back().error += own_min;
+            }
+        }
+        long long total = observed + other.observed;
+        if (all.size() > capacity) {
+            std::nth_element(all.begin(), all.begin() + capacity, all.end(), [](const Counter &a, const Counter &b) {
+                return a.count > b.count;
+            });
+            all.resize(capacity);
+        }
+        counters.clear();
+        heap.clear();
+        std::fill(slots.begin(), slots.end(), 0);
+        live = 0;
+        tombstones = 0;
+        for (Counter &counter : all) {
+            counter.heap_pos = (uint32_t) heap.size();
+            counters.push_back(std::move(counter));
+            heap.push_back((uint32_t) counters.size() - 1);
+            sift_up(heap.size() - 1);
+            insert(counters.back().hash, (uint32_t) counters.size() - 1);
+        }
+        observed = total;
+    }
+
+    /**
+     * no count is more than this above the true count
+     */
+    long long min_count() const {
+        return counters.size() < capacity || heap.empty() ? 0 : counters[heap[0]].count;
+    }
+
+    /**
+     * the largest error of a kept count, a key that was dropped may have been counted up to min_count()
+     */
+    long long max_error() const {
+        long long worst = 0;
+        for (const Counter &counter : counters) {
+            worst = std::max(worst, counter.error);
+        }
+        return worst;
+    }
+
+    long long total() const {
+        return observed;
+    }
+
+    const std::vector<Counter> &entries() const {
+        return counters;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = counters.capacity() * sizeof(Counter) + heap.capacity() * sizeof(uint32_t)
+                       + slots.capacity() * sizeof(uint32_t);
+        for (const Counter &counter : counters) {
+            bytes += counter.key.capacity() > 15 ? counter.key.capacity() : 0;
+        }
+        return bytes;
+    }
+
+private:
+    static const uint32_t NONE = 0xffffffffu;
+    static const uint32_t TOMBSTONE = 0xffffffffu;
+
+    uint32_t find(const char *key, size_t size, uint64_t hash) const {
+        if (slots.empty()) {
+            return NONE;
+        }
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            uint32_t slot = slots[i];
+            if (slot == 0) {
+                return NONE;
+            }
+            if (slot != TOMBSTONE) {
+                const Counter &counter = counters[slot - 1];
+                if (counter.hash == hash && counter.key.size() == size && memcmp(counter.key.data(), key, size) == 0) {
+                    return slot - 1;
+                }
+            }
+        }
+    }
+
+    void insert(uint64_t hash, uint32_t index) {
+        if ((live + tombstones + 1) * 10 > slots.size() * 7) {
+            // the counter already holds its key, the rebuild indexes it with all the others
+            rebuild();
+            return;
+        }
+        size_t i = hash & mask;
+        while (slots[i] != 0 && slots[i] != TOMBSTONE) {
+            i = (i + 1) & mask;
+        }
+        if (slots[i] == TOMBSTONE) {
+            tombstones--;
+        }
+        slots[i] = index + 1;
+        live++;
+    }
+
+    void erase(uint64_t hash, uint32_t index) {
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            if (slots[i] == index + 1) {
+                slots[i] = TOMBSTONE;
+                tombstones++;
+                live--;
+                return;
+            }
+        }
+    }
+
+    /**
+     * drop the tombstones, growing once the counters need it
+     */
+    void rebuild() {
+        size_t capacity_needed = 16;
+        while (capacity_needed * 7 < counters.size() * 20) {
+            capacity_needed *= 2;
+        }
+        std::vector<uint32_t>(capacity_needed, 0).swap(slots);
+        mask = capacity_needed - 1;
+        tombstones = 0;
+        live = 0;
+        for (uint32_t n = 0; n < counters.size(); n++) {
+            size_t i = counters[n].hash & mask;
+            while (slots[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = n + 1;
+            live++;
+        }
+    }
+
+    bool smaller(size_t a, size_t b) const {
+        return counters[heap[a]].count < counters[heap[b]].count;
+    }
+
+    void swap_heap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        counters[heap[a]].heap_pos = (uint32_t) a;
+        counters[heap[b]].heap_pos = (uint32_t) b;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0 && smaller(i, (i - 1) / 2)) {
+            swap_heap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t i) {
+        for (;;) {
+            size_t least = i, left = 2 * i + 1, right = left + 1;
+            if (left < heap.size() && smaller(left, least)) {
+                least = left;
+            }
+            if (right < heap.size() && smaller(right, least)) {
+                least = right;
+            }
+            if (least == i) {
+                return;
+            }
+            swap_heap(i, least);
+            i = least;
+        }
+    }
+
+    size_t capacity;
+    std::vector<Counter> counters;
+    std::vector<uint32_t> heap;
+    std::vector<uint32_t> slots;
+    size_t mask = 0;
+    size_t live = 0;
+    size_t tombstones = 0;
+    long long observed = 0;
+};
+
+/**
+ * one SpaceSaving per key length, the probabilities of the model are per length as well
+ */
+class LengthSketches {
+public:
+    static const int MAX_LENGTH = 256;
+
+    void set_capacity(size_t counters) {
+        capacity = counters;
+    }
+
+    void add(const char *key, size_t size, long long delta = 1) {
+        if (sketches.empty()) {
+            sketches.resize(MAX_LENGTH, SpaceSaving(capacity));
+        }
+        sketches[size < MAX_LENGTH ? size : MAX_LENGTH - 1].add(key, size, delta);
+    }
+
+    void add(const std::string &key, long long delta = 1) {
+        add(key.data(), key.size(), delta);
+    }
+
+    void merge(LengthSketches &other) {
+        if (other.sketches.empty()) {
+            return;
+        }
+        if (sketches.empty()) {
+            sketches.swap(other.sketches);
+            return;
+        }
+        for (int i = 0; i < MAX_LENGTH; i++) {
+            sketches[i].merge(other.sketches[i]);
+        }
+        std::vector<SpaceSaving>().swap(other.sketches);
+    }
+
+    /**
+     * put the estimated counts into table and forget them
+     */
+    void export_to(CountTable &table) {
+        for (const SpaceSaving &sketch : sketches) {
+            for (const SpaceSaving::Counter &counter : sketch.entries()) {
+                table.add(counter.key, counter.count);
+            }
+        }
+        std::vector<SpaceSaving>().swap(sketches);
+    }
+
+    /**
+     * the largest error of a count relative to the total of its length
+     */
+    double max_relative_error() const {
+        double worst = 0;
+        for (const SpaceSaving &sketch : sketches) {
+            if (sketch.total() > 0) {
+                worst = std::max(worst, (double) sketch.max_error() / (double) sketch.total());
+            }
+        }
+        return worst;
+    }
+
+    long long max_error() const {
+        long long worst = 0;
+        for (const SpaceSaving &sketch : sketches) {
+            worst = std::max(worst, sketch.max_error());
+        }
+        return worst;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (const SpaceSaving &sketch : sketches) {
+            n += sketch.entries().size();
+        }
+        return n;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for (const SpaceSaving &sketch : sketches) {
+            bytes += sketch.memory_bytes();
+        }
+        return bytes;
+    }
+
+private:
+    size_t capacity = 1024;
+    std::vector<SpaceSaving> sketches;
+};
+
+#endif //TRANSPCFG_HEAVY_HITTERS_H
@@ -0,0 +1,496 @@
+#ifndef TRANSPCFG_MODEL_FILE_H
+#define TRANSPCFG_MODEL_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+
+/**
+ * model.bin, the whole trained model in one file that guess maps and uses in place.
+ * native byte order, every section starts on an 8-byte boundary, offsets are from the start of the file.
+ *
+ *   ModelFileHeader
+ *   for digits, special and letters:
+ *     ModelLength[MODEL_MAX_LENGTH]     groups of terminals with length i: groups[first_group, +group_count)
+ *     ModelGroup[group_count]           probability groups, most probable first, words[first_word, +word_count)
+ *     uint64_t[word_count + 1]          offsets of the words in the pool
+ *     char[pool_size]                   the words
+ *   structures:
+ *     ModelStructure[count]             most probable first, keys as in structure_key.h
+ *     char[pool_size]                   the keys
+ */
+const char MODEL_FILE_MAGIC[8] = {'T', 'P', 'C', 'F', 'G', 'B', 'I', 'N'};
+const uint32_t MODEL_FILE_VERSION = 1;
+const int MODEL_MAX_LENGTH = 256;
+
+enum ModelTerminalKind {
+    MODEL_DIGITS = 0,
+    MODEL_SPECIAL = 1,
+    MODEL_LETTERS = 2,
+    MODEL_TERMINAL_KINDS = 3
+};
+
+struct ModelLength {
+    uint64_t first_group;
+    uint64_t group_count;
+};
+
+struct ModelGroup {
+    double probability;
+    uint64_t first_word;
+    uint64_t word_count;
+};
+
+struct ModelStructure {
+    double probability;
+    uint64_t key_offset;
+    uint32_t key_size;
+    uint32_t reserved;
+};
+
+struct ModelTerminalSection {
+    uint64_t lengths_offset;
+    uint64_t groups_offset;
+    uint64_t group_count;
+    uint64_t word_offsets_offset;
+    uint64_t word_count;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+struct ModelStructureSection {
+    uint64_t records_offset;
+    uint64_t count;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    ModelTerminalSection terminals[MODEL_TERMINAL_KINDS];
+    ModelStructureSection structures;
+};
+
+/**
+ * the size guess gives a dictionary word: bytes, except that a byte >= 128 swallows the byte before it
+ */
+inline int model_word_size(const char *word, size_t size) {
+    int length = 0;
+    for (long i = (long) size - 1; i >= 0; i--) {
+        if ((unsigned int) word[i] > 127) { //it is a non-ascii char
+            i--;
+        }
+        length++;
+    }
+    return length;
+}
+
+/**
+ * collects the terminals of one kind, length by length, most probable first.
+ * consecutive words with the same probability form one group.
+ * for example,
+ * ModelTerminalsBuilder digits;
+ * digits.add(2, 0.5, "12", 2);
+ * digits.add(2, 0.5, "99", 2);  // same group as "12"
+ */
+class ModelTerminalsBuilder {
+public:
+    ModelTerminalsBuilder() : lengths(MODEL_MAX_LENGTH, ModelLength{0, 0}) {
+        offsets.push_back(0);
+    }
+
+    /**
+     * lengths have to come in increasing order, words of a length by decreasing probability
+     */
+    void add(int length, double probability, const char *word, size_t size) {
+        if (length < 0 || length >= MODEL_MAX_LENGTH) {
+            return;
+        }
+        ModelLength &cur = lengths[length];
+        if (cur.group_count == 0 || groups.back().probability != probability) {
+            if (cur.group_count == 0) {
+                cur.first_group = groups.size();
+            }
+            groups.push_back(ModelGroup{probability, offsets.size() - 1, 0});
+            cur.group_count++;
+        }
+        groups.back().word_count++;
+        pool.append(word, size);
+        offsets.push_back(pool.size());
+    }
+
+    void clear() {
+        lengths.assign(MODEL_MAX_LENGTH, ModelLength{0, 0});
+        std::vector<ModelGroup>().swap(groups);
+        std::vector<uint64_t>(1, 0).swap(offsets);
+        std::string().swap(pool);
+    }
+
+    std::vector<ModelLength> lengths;
+    std::vector<ModelGroup> groups;
+    std::vector<uint64_t> offsets;
+    std::string pool;
+};
+
+/**
+ * collects the structures, most probable first
+ */
+class ModelStructuresBuilder {
+public:
+    void add(double probability, const char *key, size_t size) {
+        records.push_back(ModelStructure{probability, pool.size(), (uint32_t) size, 0});
+        pool.append(key, size);
+    }
+
+    std::vector<ModelStructure> records;
+    std::string pool;
+};
+
+/**
+ * writes model.bin section by section. the file is written as path + ".tmp"
+ * and only renamed to path by close() once everything is on disk.
+ * with open_memory() the same bytes go to image() instead, for a model that is used in place right away.
+ */
+class ModelFileWriter {
+public:
+    ~ModelFileWriter() {
+        if (file != nullptr) {
+            std::fclose(file);
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+    bool open(const std::string &model_file) {
+        path = model_file;
+        tmp_path = model_file + ".tmp";
+        file = std::fopen(tmp_path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+        header.version = MODEL_FILE_VERSION;
+        header.header_size = sizeof(ModelFileHeader);
+        offset = 0;
+        ok = true;
+        append(&header, sizeof(header));
+        return ok;
+    }
+
+    void open_memory() {
+        path.clear();
+        memory.clear();
+        in_memory = true;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+        header.version = MODEL_FILE_VERSION;
+        header.header_size = sizeof(ModelFileHeader);
+        offset = 0;
+        ok = true;
+        append(&header, sizeof(header));
+    }
+
+    bool is_open() const {
+        return file != nullptr || in_memory;
+    }
+
+    void write_terminals(ModelTerminalKind kind, const ModelTerminalsBuilder &builder) {
+        ModelTerminalSection &section = header.terminals[kind];
+        section.lengths_offset = append(builder.lengths.data(), builder.lengths.size() * sizeof(ModelLength));
+        section.group_count = builder.groups.size();
+        section.groups_offset = append(builder.groups.data(), builder.groups.size() * sizeof(ModelGroup));
+        section.word_count = builder.offsets.size() - 1;
+        section.word_offsets_offset = append(builder.offsets.data(), builder.offsets.size() * sizeof(uint64_t));
+        section.pool_size = builder.pool.size();
+        section.pool_offset = append(builder.pool.data(), builder.pool.size());
+    }
+
+    void write_structures(const ModelStructuresBuilder &builder) {
+        header.structures.count = builder.records.size();
+        header.structures.records_offset = append(builder.records.data(),
+                                                  builder.records.size() * sizeof(ModelStructure));
+        header.structures.pool_size = builder.pool.size();
+        header.structures.pool_offset = append(builder.pool.data(), builder.pool.size());
+    }
+
+    /**
+     * write the final header and move the file into place
+     */
+    bool close() {
+        if (in_memory) {
+            memcpy(&memory[0], &header, sizeof(header));
+            in_memory = false;
+            return true;
+        }
+        if (file == nullptr) {
+            return false;
+        }
+        ok = ok && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+        // on disk before the rename makes it the model
+        ok = ok && std::fflush(file) == 0;
+#ifndef _WIN32
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        if (ok) {
+            ok = std::rename(tmp_path.c_str(), path.c_str()) == 0;
+        }
+        if (!ok) {
+            std::remove(tmp_path.c_str());
+        }
+        return ok;
+    }
+
+    /**
+     * the model written since open_memory(), complete after close()
+     */
+    const std::string &image() const {
+        return memory;
+    }
+
+private:
+    /**
+     * append size bytes, padded to 8, returns where they start
+     */
+    uint64_t append(const void *data, size_t size) {
+        uint64_t start = offset;
+        static const char zeros[8] = {0};
+        size_t padding = (8 - size % 8) % 8;
+        if (in_memory) {
+            memory.append((const char *) data, size);
+            memory.append(zeros, padding);
+        } else if (file != nullptr && ok) {
+            ok = (size == 0 || std::fwrite(data, size, 1, file) == 1)
+                 && (padding == 0 || std::fwrite(zeros, padding, 1, file) == 1);
+        }
+        offset += size + padding;
+        return start;
+    }
+
+    std::string path;
+    std::string tmp_path;
+    std::FILE *file = nullptr;
+    ModelFileHeader header{};
+    uint64_t offset = 0;
+    bool ok = false;
+    bool in_memory = false;
+    std::string memory;
+};
+
+/**
+ * a mapped model.bin, everything is used in place
+ * for example,
+ * ModelFile model;
+ * if (model.open("model.bin")) {
+ *     for (uint64_t g = 0; g < model.group_count(MODEL_DIGITS, 4); g++) ...
+ * }
+ */
+class ModelFile {
+public:
+    ModelFile() = default;
+
+    ~ModelFile() {
+        close();
+    }
+
+    ModelFile(const ModelFile &) = delete;
+
+    ModelFile &operator=(const ModelFile &) = delete;
+
+    /**
+     * map the file, false if it is missing or not a valid model
+     */
+    bool open(const std::string &path) {
+        close();
+#ifdef _WIN32
+        return false;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ModelFileHeader)) {
+            ::close(fd);
+            return false;
+        }
+        void *addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        mapped = true;
+        data = (const char *) addr;
+        size = (size_t) st.st_size;
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    /**
+     * use a model that is already in memory (ModelFileWriter::image()), it has to outlive this object
+     */
+    bool open_memory(const char *image, size_t image_size) {
+        close();
+        if (image_size < sizeof(ModelFileHeader)) {
+            return false;
+        }
+        data = image;
+        size = image_size;
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (mapped && data != nullptr) {
+            munmap((void *) data, size);
+        }
+#endif
+        mapped = false;
+        data = nullptr;
+        size = 0;
+    }
+
+    const ModelFileHeader &header() const {
+        return *(const ModelFileHeader *) data;
+    }
+
+    uint64_t group_count(ModelTerminalKind kind, int length) const {
+        return lengths(kind)[length].group_count;
+    }
+
+    /**
+     * the g-th most probable group of terminals with the given length
+     */
+    const ModelGroup &group(ModelTerminalKind kind, int length, uint64_t g) const {
+        const ModelTerminalSection &section = header().terminals[kind];
+        auto *groups = (const ModelGroup *) (data + section.groups_offset);
+        return groups[lengths(kind)[length].first_group + g];
+    }
+
+    /**
+     * a group whose words are all in the offsets of its kind, checked by whoever uses it
+     */
+    bool valid_group(ModelTerminalKind kind, const ModelGroup &group) const {
+        uint64_t word_count = header().terminals[kind].word_count;
+        return group.first_word <= word_count && group.word_count <= word_count - group.first_word;
+    }
+
+    /**
+     * word index of a valid group, its offsets are not checked: they have to be increasing and at most
+     * word_pool_size(kind)
+     */
+    const char *word(ModelTerminalKind kind, uint64_t index, size_t &word_size) const {
+        const ModelTerminalSection &section = header().terminals[kind];
+        auto *offsets = (const uint64_t *) (data + section.word_offsets_offset);
+        word_size = (size_t) (offsets[index + 1] - offsets[index]);
+        return data + section.pool_offset + offsets[index];
+    }
+
+    /**
+     * the words of a kind back to back, word i is pool[offsets[i], offsets[i + 1]).
+     * both stay valid while the model is open, a group's words start at offsets + first_word.
+     */
+    const char *word_pool(ModelTerminalKind kind) const {
+        return data + header().terminals[kind].pool_offset;
+    }
+
+    const uint64_t *word_offsets(ModelTerminalKind kind) const {
+        return (const uint64_t *) (data + header().terminals[kind].word_offsets_offset);
+    }
+
+    uint64_t word_pool_size(ModelTerminalKind kind) const {
+        return header().terminals[kind].pool_size;
+    }
+
+    uint64_t structure_count() const {
+        return header().structures.count;
+    }
+
+    const ModelStructure &structure(uint64_t index) const {
+        return ((const ModelStructure *) (data + header().structures.records_offset))[index];
+    }
+
+    /**
+     * a structure whose key is in the pool, checked by whoever uses it
+     */
+    bool valid_structure(const ModelStructure &record) const {
+        uint64_t pool_size = header().structures.pool_size;
+        return record.key_offset <= pool_size && record.key_size <= pool_size - record.key_offset;
+    }
+
+    const char *structure_key(const ModelStructure &record) const {
+        return data + header().structures.pool_offset + record.key_offset;
+    }
+
+private:
+    const ModelLength *lengths(ModelTerminalKind kind) const {
+        return (const ModelLength *) (data + header().terminals[kind].lengths_offset);
+    }
+
+    bool in_file(uint64_t offset, uint64_t bytes) const {
+        return offset <= size && bytes <= size - offset;
+    }
+
+    /**
+     * check the header and that every table lies inside the file, so a truncated or foreign file is rejected
+     * without reading the tables. what a group or a structure refers to is checked where it is used
+     * (valid_group, valid_structure), the words when their group is used
+     */
+    bool validate() const {
+        const ModelFileHeader &h = header();
+        if (memcmp(h.magic, MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC)) != 0
+            || h.version != MODEL_FILE_VERSION || h.header_size != sizeof(ModelFileHeader)) {
+            return false;
+        }
+        for (int kind = 0; kind < MODEL_TERMINAL_KINDS; kind++) {
+            const ModelTerminalSection &s = h.terminals[kind];
+            if (!in_file(s.lengths_offset, MODEL_MAX_LENGTH * sizeof(ModelLength))
+                || s.group_count > size / sizeof(ModelGroup)
+                || !in_file(s.groups_offset, s.group_count * sizeof(ModelGroup))
+                || s.word_count >= size / sizeof(uint64_t)
+                || !in_file(s.word_offsets_offset, (s.word_count + 1) * sizeof(uint64_t))
+                || !in_file(s.pool_offset, s.pool_size)) {
+                return false;
+            }
+            auto *lens = (const ModelLength *) (data + s.lengths_offset);
+            for (int i = 0; i < MODEL_MAX_LENGTH; i++) {
+                if (lens[i].first_group > s.group_count || lens[i].group_count > s.group_count - lens[i].first_group) {
+                    return false;
+                }
+            }
+        }
+        const ModelStructureSection &st = h.structures;
+        if (st.count > size / sizeof(ModelStructure) || !in_file(st.records_offset, st.count * sizeof(ModelStructure))
+            || !in_file(st.pool_offset, st.pool_size)) {
+            return false;
+        }
+        return true;
+    }
+
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+};
+
+#endif //TRANSPCFG_MODEL_FILE_H
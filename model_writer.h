@@ -0,0 +1,459 @@
+#ifndef TRANSPCFG_MODEL_WRITER_H
+#define TRANSPCFG_MODEL_WRITER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * a non-negative integer of up to 1280 bits, what shortest_digits needs for any double
+ */
+class DigitBignum {
+public:
+    explicit DigitBignum(uint64_t value = 0) {
+        while (value != 0) {
+            limbs[size++] = (uint32_t) value;
+            value >>= 32u;
+        }
+    }
+
+    void shift_left(int bits) {
+        int words = bits / 32, rest = bits % 32;
+        if (size == 0) {
+            return;
+        }
+        limbs[size] = 0;
+        if (rest != 0) {
+            for (int i = size; i > 0; i--) {
+                limbs[i] = (limbs[i] << rest) | (limbs[i - 1] >> (32 - rest));
+            }
+            limbs[0] <<= rest;
+            size += limbs[size] != 0;
+        }
+        if (words != 0) {
+            memmove(limbs + words, limbs, size * sizeof(uint32_t));
+            memset(limbs, 0, words * sizeof(uint32_t));
+            size += words;
+        }
+    }
+
+    void multiply(uint32_t factor) {
+        uint64_t carry = 0;
+        for (int i = 0; i < size; i++) {
+            carry += (uint64_t) limbs[i] * factor;
+            limbs[i] = (uint32_t) carry;
+            carry >>= 32u;
+        }
+        if (carry != 0) {
+            limbs[size++] = (uint32_t) carry;
+        }
+    }
+
+    void multiply_pow10(int exponent) {
+        static const uint32_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+                                         1000000000};
+        for (; exponent >= 9; exponent -= 9) {
+            multiply(POW10[9]);
+        }
+        multiply(POW10[exponent]);
+    }
+
+    void add(const DigitBignum &other) {
+        uint64_t carry = 0;
+        int n = size > other.size ? size : other.size;
+        for (int i = 0; i < n; i++) {
+            carry += (uint64_t) (i < size ? limbs[i] : 0) + (i < other.size ? other.limbs[i] : 0);
+            limbs[i] = (uint32_t) carry;
+            carry >>= 32u;
+        }
+        size = n;
+        if (carry != 0) {
+            limbs[size++] = (uint32_t) carry;
+        }
+    }
+
+    /**
+     * other has to be at most this
+     */
+    void subtract(const DigitBignum &other) {
+        int64_t borrow = 0;
+        for (int i = 0; i < size; i++) {
+            borrow += (int64_t) limbs[i] - (i < other.size ? other.limbs[i] : 0);
+            limbs[i] = (uint32_t) borrow;
+            borrow = borrow < 0 ? -1 : 0;
+        }
+        while (size > 0 && limbs[size - 1] == 0) {
+            size--;
+        }
+    }
+
+    static int compare(const DigitBignum &lhs, const DigitBignum &rhs) {
+        if (lhs.size != rhs.size) {
+            return lhs.size < rhs.size ? -1 : 1;
+        }
+        for (int i = lhs.size - 1; i >= 0; i--) {
+            if (lhs.limbs[i] != rhs.limbs[i]) {
+                return lhs.limbs[i] < rhs.limbs[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+
+private:
+    static const int LIMBS = 40;
+    uint32_t limbs[LIMBS + 1] = {0};
+    int size = 0;
+};
+
+/**
+ * the fewest decimal digits that read back (round to nearest even) as the positive, finite value,
+ * the closest to it of those. value is 0.digits * 10^exponent, the number of digits is returned.
+ * this is the free-format algorithm of Steele and White as Burger and Dybvig give it: the digits are made
+ * one by one until the rest of the value lies within half a gap to either neighbour of value.
+ * value = mantissa * 2^binary_exponent, boundary if its neighbour below is only half as far away as the one above
+ */
+inline int shortest_digits(uint64_t mantissa, int binary_exponent, bool boundary, double value, char *digits,
+                           int &exponent) {
+    // r / s is the value, m_plus / s and m_minus / s the gaps to its neighbours halved
+    DigitBignum r(mantissa), s(1), m_plus(1), m_minus(1);
+    // a power of two has a neighbour below it that is only half as far away
+    int shift = boundary ? 2 : 1;
+    if (binary_exponent >= 0) {
+        r.shift_left(binary_exponent + shift);
+        s.shift_left(shift);
+        m_plus.shift_left(binary_exponent + shift - 1);
+        m_minus.shift_left(binary_exponent);
+    } else {
+        r.shift_left(shift);
+        s.shift_left(shift - binary_exponent);
+        m_plus.shift_left(shift - 1);
+    }
+    // an even mantissa wins the ties, so the bounds of its interval read back as the value as well
+    bool even = mantissa % 2 == 0;
+    int k = (int) std::ceil(std::log10(value) - 1e-10);
+    if (k >= 0) {
+        s.multiply_pow10(k);
+    } else {
+        r.multiply_pow10(-k);
+        m_plus.multiply_pow10(-k);
+        m_minus.multiply_pow10(-k);
+    }
+    DigitBignum high = r;
+    high.add(m_plus);
+    int above = DigitBignum::compare(high, s);
+    if (above > 0 || (even && above == 0)) {
+        s.multiply(10);
+        k++;
+    }
+    exponent = k;
+    int count = 0;
+    while (true) {
+        r.multiply(10);
+        m_plus.multiply(10);
+        m_minus.multiply(10);
+        int digit = 0;
+        while (DigitBignum::compare(r, s) >= 0) {
+            r.subtract(s);
+            digit++;
+        }
+        int below = DigitBignum::compare(r, m_minus);
+        high = r;
+        high.add(m_plus);
+        above = DigitBignum::compare(high, s);
+        bool low_ends = below < 0 || (even && below == 0);
+        bool high_ends = above > 0 || (even && above == 0);
+        if (!low_ends && !high_ends) {
+            digits[count++] = (char) ('0' + digit);
+            continue;
+        }
+        if (low_ends && high_ends) {
+            // both digits read back, the closer one, the even one if value is right between them
+            DigitBignum twice = r;
+            twice.add(r);
+            int half = DigitBignum::compare(twice, s);
+            high_ends = half > 0 || (half == 0 && digit % 2 == 1);
+        }
+        digits[count++] = (char) ('0' + digit + (high_ends ? 1 : 0));
+        return count;
+    }
+}
+
+/**
+ * printf's "%.Ng" of 0.digits * 10^exponent with N = count, without the trailing zeros it would drop anyway
+ */
+inline int format_general(char *out, bool negative, const char *digits, int count, int exponent) {
+    char *at = out;
+    if (negative) {
+        *at++ = '-';
+    }
+    int x = exponent - 1;
+    if (x < -4 || x >= count) {
+        *at++ = digits[0];
+        if (count > 1) {
+            *at++ = '.';
+            memcpy(at, digits + 1, count - 1);
+            at += count - 1;
+        }
+        *at++ = 'e';
+        *at++ = x < 0 ? '-' : '+';
+        int magnitude = x < 0 ? -x : x;
+        if (magnitude >= 100) {
+            *at++ = (char) ('0' + magnitude / 100);
+        }
+        *at++ = (char) ('0' + magnitude / 10 % 10);
+        *at++ = (char) ('0' + magnitude % 10);
+    } else if (x >= 0) {
+        memcpy(at, digits, x + 1);
+        at += x + 1;
+        if (count > x + 1) {
+            *at++ = '.';
+            memcpy(at, digits + x + 1, count - x - 1);
+            at += count - x - 1;
+        }
+    } else {
+        *at++ = '0';
+        *at++ = '.';
+        for (int i = -1; i > x; i--) {
+            *at++ = '0';
+        }
+        memcpy(at, digits, count);
+        at += count;
+    }
+    *at = '\0';
+    return (int) (at - out);
+}
+
+/**
+ * printf's "%g" of an infinity or a NaN
+ */
+inline int format_special(char *out, bool negative, bool nan) {
+    char *at = out;
+    if (negative) {
+        *at++ = '-';
+    }
+    memcpy(at, nan ? "nan" : "inf", 4);
+    return (int) (at - out) + 3;
+}
+
+/**
+ * the shortest "%g" form of value that reads back (strtof) as the same float, at most 9 digits.
+ * a float has about 7 significant digits, printing 30 of them only costs time and space.
+ * out needs 32 bytes.
+ * for example,
+ * char buf[32];
+ * format_shortest(buf, 0.1f);  // "0.1", 3
+ */
+inline int format_shortest(char *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bool negative = (bits >> 31u) != 0;
+    uint32_t fraction = bits & 0x7fffffu;
+    auto biased = (int) ((bits >> 23u) & 0xffu);
+    if (biased == 0xff) {
+        return format_special(out, negative, fraction != 0);
+    }
+    if (biased == 0 && fraction == 0) {
+        return format_general(out, negative, "0", 1, 1);
+    }
+    char digits[32];
+    int exponent;
+    // subnormals have no hidden bit and the exponent of the smallest normal
+    uint64_t mantissa = biased == 0 ? fraction : fraction | 0x800000u;
+    int count = shortest_digits(mantissa, (biased == 0 ? 1 : biased) - 127 - 23, biased > 1 && fraction == 0,
+                                std::fabs((double) value), digits, exponent);
+    return format_general(out, negative, digits, count, exponent);
+}
+
+/**
+ * the same for doubles (strtod), at most 17 digits
+ */
+inline int format_shortest(char *out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bool negative = (bits >> 63u) != 0;
+    uint64_t fraction = bits & 0xfffffffffffffULL;
+    auto biased = (int) ((bits >> 52u) & 0x7ffu);
+    if (biased == 0x7ff) {
+        return format_special(out, negative, fraction != 0);
+    }
+    if (biased == 0 && fraction == 0) {
+        return format_general(out, negative, "0", 1, 1);
+    }
+    char digits[32];
+    int exponent;
+    uint64_t mantissa = biased == 0 ? fraction : fraction | 0x10000000000000ULL;
+    int count = shortest_digits(mantissa, (biased == 0 ? 1 : biased) - 1023 - 52, biased > 1 && fraction == 0,
+                                std::fabs(value), digits, exponent);
+    return format_general(out, negative, digits, count, exponent);
+}
+
+/**
+ * hand what was written to file to the system and have it start writing to disk without waiting for it,
+ * before the file is closed. sync_model_dir waits for all the files at once
+ */
+inline bool start_sync(std::FILE *file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fileno(file), 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+    return true;
+}
+
+/**
+ * writes a text file through one large buffer instead of flushing every line.
+ * the file starts going to disk when it is closed, call sync_model_dir once all files are written.
+ * for example,
+ * BufferedFileWriter fout;
+ * if (fout.open("digits/4.txt")) { fout.write("1234", 4); fout.put('\t'); fout.write_number(0.4f); fout.put('\n'); }
+ * fout.close();
+ */
+class BufferedFileWriter {
+public:
+    static const size_t BUFFER_SIZE = 1u << 20u;
+
+    BufferedFileWriter() = default;
+
+    ~BufferedFileWriter() {
+        close();
+    }
+
+    BufferedFileWriter(const BufferedFileWriter &) = delete;
+
+    BufferedFileWriter &operator=(const BufferedFileWriter &) = delete;
+
+    bool open(const std::string &path) {
+        close();
+        file = std::fopen(path.c_str(), "wb");
+        broken = file == nullptr;
+        buffer.reserve(BUFFER_SIZE);
+        return !broken;
+    }
+
+    bool is_open() const {
+        return file != nullptr;
+    }
+
+    void write(const char *data, size_t size) {
+        if (buffer.size() + size > BUFFER_SIZE) {
+            flush();
+        }
+        if (size >= BUFFER_SIZE) {
+            broken = broken || file == nullptr || std::fwrite(data, 1, size, file) != size;
+            return;
+        }
+        buffer.append(data, size);
+    }
+
+    void write(const std::string &data) {
+        write(data.data(), data.size());
+    }
+
+    void put(char c) {
+        if (buffer.size() == BUFFER_SIZE) {
+            flush();
+        }
+        buffer.push_back(c);
+    }
+
+    /**
+     * the probabilities come sorted, so most of them equal the one before and are formatted only once
+     */
+    template<typename Number>
+    void write_number(Number value) {
+        if (number_size == 0 || (double) value != number || sizeof(Number) != number_type) {
+            number = (double) value;
+            number_type = sizeof(Number);
+            number_size = format_shortest(number_text, value);
+        }
+        write(number_text, (size_t) number_size);
+    }
+
+    /**
+     * false if anything could not be written
+     */
+    bool close() {
+        if (file == nullptr) {
+            buffer.clear();
+            return !broken;
+        }
+        flush();
+        broken = !start_sync(file) || broken;
+        broken = std::fclose(file) != 0 || broken;
+        file = nullptr;
+        return !broken;
+    }
+
+private:
+    void flush() {
+        if (!buffer.empty()) {
+            broken = broken || file == nullptr || std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size();
+            buffer.clear();
+        }
+    }
+
+    std::FILE *file = nullptr;
+    std::string buffer;
+    bool broken = false;
+    char number_text[32];
+    int number_size = 0;
+    double number = 0;
+    size_t number_type = 0;
+};
+
+/**
+ * one pass at the end of writing: fsync every file and directory below dir, dir included.
+ * the files were already being written out since they were closed (start_sync), so most of this is waiting
+ * for what is left, once per file instead of while every file is closed
+ */
+inline bool sync_model_dir(const std::string &dir) {
+#ifdef _WIN32
+    (void) dir;
+    return true;
+#else
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    DIR *entries = opendir(dir.c_str());
+    if (entries == nullptr) {
+        return false;
+    }
+    std::string base = dir.empty() || dir[dir.size() - 1] == '/' ? dir : dir + '/';
+    while (dirent *entry = readdir(entries)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        struct stat st{};
+        if (lstat((base + name).c_str(), &st) != 0) {
+            ok = false;
+        } else if (S_ISDIR(st.st_mode)) {
+            ok = sync_model_dir(base + name) && ok;
+        } else if (S_ISREG(st.st_mode)) {
+            int file = ::open((base + name).c_str(), O_RDONLY);
+            ok = file >= 0 && fsync(file) == 0 && ok;
+            if (file >= 0) {
+                ::close(file);
+            }
+        }
+    }
+    closedir(entries);
+    return ok;
+#endif
+}
+
+#endif //TRANSPCFG_MODEL_WRITER_H
@@ -0,0 +1,277 @@
+#ifndef TRANSPCFG_SEGMENTER_H
+#define TRANSPCFG_SEGMENTER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "structure_key.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TRANSPCFG_SEGMENTER_SIMD 1
+#include <immintrin.h>
+#endif
+
+
+/**
+ * 256-entry lookup table, byte -> CharClass
+ */
+inline const unsigned char *char_class_table() {
+    struct Table {
+        unsigned char cls[256];
+
+        Table() {
+            for (int c = 0; c < 256; c++) {
+                if ('0' <= c && c <= '9') {
+                    cls[c] = CLASS_DIGIT;
+                } else if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')) {
+                    cls[c] = CLASS_LETTER;
+                } else if (c < 128) {
+                    cls[c] = CLASS_SPECIAL;
+                } else {
+                    cls[c] = CLASS_SPECIAL | CLASS_NON_ASCII;
+                }
+            }
+        }
+    };
+    static const Table table;
+    return table.cls;
+}
+
+/**
+ * how Segmenter classifies bytes, picked at runtime from what the cpu supports
+ */
+enum SegmenterKernel {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE2 = 1,
+    KERNEL_AVX2 = 2
+};
+
+/**
+ * the best kernel this cpu can run
+ */
+inline SegmenterKernel best_segmenter_kernel() {
+#ifdef TRANSPCFG_SEGMENTER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return KERNEL_AVX2;
+    }
+    // x86-64 always has sse2
+    return KERNEL_SSE2;
+#else
+    return KERNEL_SCALAR;
+#endif
+}
+
+inline const char *segmenter_kernel_name(SegmenterKernel kernel) {
+    return kernel == KERNEL_AVX2 ? "avx2" : kernel == KERNEL_SSE2 ? "sse2" : "scalar";
+}
+
+/**
+ * a run of characters of the same class, line[offset, offset + length)
+ */
+struct Segment {
+    int offset;
+    int length;
+    int cls;
+};
+
+/**
+ * splits a password into its digit, letter and special runs in one scan.
+ * the run buffer is reused, so after warming up there is no allocation per line.
+ * for example,
+ * Segmenter seg;
+ * seg.split("abc123!", 7);  // runs: (0, 3, L) (3, 3, D) (6, 1, S)
+ */
+class Segmenter {
+public:
+    explicit Segmenter(SegmenterKernel kernel = best_segmenter_kernel()) : table(char_class_table()) {
+        runs.reserve(256);
+#ifdef TRANSPCFG_SEGMENTER_SIMD
+        this->kernel = kernel;
+#else
+        this->kernel = KERNEL_SCALAR;
+#endif
+    }
+
+    void split(const char *line, int size) {
+#ifdef TRANSPCFG_SEGMENTER_SIMD
+        if (kernel == KERNEL_AVX2) {
+            split_avx2(line, size);
+            return;
+        } else if (kernel == KERNEL_SSE2) {
+            split_sse2(line, size);
+            return;
+        }
+#endif
+        split_scalar(line, size);
+    }
+
+    const std::vector<Segment> &segments() const {
+        return runs;
+    }
+
+    /**
+     * the packed structure key of the last line (see structure_key.h), "LLLDDDS" -> {L|3, D|3, S|1}.
+     * it stops at the first non-ASCII byte.
+     */
+    void structure_key(std::string &out) const {
+        out.clear();
+        for (const Segment &run : runs) {
+            if (run.offset >= ascii_size) {
+                break;
+            }
+            int length = run.offset + run.length <= ascii_size ? run.length : ascii_size - run.offset;
+            append_structure_run(out, run.cls, length);
+        }
+    }
+
+private:
+    void split_scalar(const char *line, int size) {
+        runs.clear();
+        ascii_size = size;
+        if (size <= 0) {
+            return;
+        }
+        auto *p = (const unsigned char *) line;
+        unsigned char seen = table[p[0]];
+        int prev = seen & CLASS_MASK;
+        int start = 0;
+        for (int i = 1; i < size; i++) {
+            unsigned char t = table[p[i]];
+            seen |= t;
+            int cls = t & CLASS_MASK;
+            if (cls != prev) {
+                runs.push_back(Segment{start, i - start, prev});
+                start = i;
+                prev = cls;
+            }
+        }
+        runs.push_back(Segment{start, size - start, prev});
+        if (seen & CLASS_NON_ASCII) {
+            for (int i = 0; i < size; i++) {
+                if (table[p[i]] & CLASS_NON_ASCII) {
+                    ascii_size = i;
+                    break;
+                }
+            }
+        }
+    }
+
+#ifdef TRANSPCFG_SEGMENTER_SIMD
+
+    /**
+     * load 32 bytes at p, of which only n are part of the line. a load that stays inside the page is
+     * safe even if it goes past the line, otherwise the tail is copied so we never touch the next page.
+     */
+    static const unsigned char *block_at(const unsigned char *p, int n, unsigned char *tail) {
+        if (n >= 32 || ((uintptr_t) p & 4095u) <= 4096u - 32u) {
+            return p;
+        }
+        memset(tail, 0, 32);
+        memcpy(tail, p, (size_t) n);
+        return tail;
+    }
+
+    /**
+     * turn the class masks of the block at base into runs.
+     * a run starts wherever the digit or the letter mask flips, carry holds the masks' last bits.
+     */
+    void emit_runs(uint32_t digits, uint32_t letters, uint32_t high, int base, int n,
+                   int &start, int &prev, uint32_t &carry_digit, uint32_t &carry_letter) {
+        if (n < 32) {
+            uint32_t valid = (1u << (unsigned) n) - 1;
+            digits &= valid;
+            letters &= valid;
+            high &= valid;
+        }
+        if (high != 0 && ascii_size > base) {
+            int first = base + __builtin_ctz(high);
+            ascii_size = first < ascii_size ? first : ascii_size;
+        }
+        uint32_t change = (digits ^ ((digits << 1u) | carry_digit)) | (letters ^ ((letters << 1u) | carry_letter));
+        if (base == 0) {
+            prev = class_at(digits, letters, 0);
+            change &= ~1u;
+        }
+        if (n < 32) {
+            change &= (1u << (unsigned) n) - 1;
+        }
+        while (change != 0) {
+            int i = __builtin_ctz(change);
+            change &= change - 1;
+            runs.push_back(Segment{start, base + i - start, prev});
+            start = base + i;
+            prev = class_at(digits, letters, i);
+        }
+        carry_digit = digits >> 31u;
+        carry_letter = letters >> 31u;
+    }
+
+    static int class_at(uint32_t digits, uint32_t letters, int i) {
+        return (digits >> (unsigned) i) & 1u ? CLASS_DIGIT : (letters >> (unsigned) i) & 1u ? CLASS_LETTER : CLASS_SPECIAL;
+    }
+
+    /**
+     * x in [lo, lo + n] <=> (unsigned char) (x - lo) <= n <=> min(x - lo, n) == x - lo.
+     * letters are folded to lower case first, bytes >= 128 never match either range.
+     */
+    __attribute__((target("avx2")))
+    void split_avx2(const char *line, int size) {
+        runs.clear();
+        ascii_size = size;
+        auto *p = (const unsigned char *) line;
+        unsigned char tail[32];
+        int start = 0, prev = CLASS_SPECIAL;
+        uint32_t carry_digit = 0, carry_letter = 0;
+        for (int base = 0; base < size; base += 32) {
+            int n = size - base;
+            __m256i v = _mm256_loadu_si256((const __m256i *) block_at(p + base, n, tail));
+            __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+            d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+            __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+            l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(25)), l);
+            emit_runs((uint32_t) _mm256_movemask_epi8(d), (uint32_t) _mm256_movemask_epi8(l),
+                      (uint32_t) _mm256_movemask_epi8(v), base, n, start, prev, carry_digit, carry_letter);
+        }
+        if (size > 0) {
+            runs.push_back(Segment{start, size - start, prev});
+        }
+    }
+
+    void split_sse2(const char *line, int size) {
+        runs.clear();
+        ascii_size = size;
+        auto *p = (const unsigned char *) line;
+        unsigned char tail[32];
+        int start = 0, prev = CLASS_SPECIAL;
+        uint32_t carry_digit = 0, carry_letter = 0;
+        for (int base = 0; base < size; base += 32) {
+            int n = size - base;
+            const unsigned char *block = block_at(p + base, n, tail);
+            uint32_t digits = 0, letters = 0, high = 0;
+            for (int half = 0; half < 32 && half < n; half += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) (block + half));
+                __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+                d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+                __m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+                l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(25)), l);
+                digits |= (uint32_t) _mm_movemask_epi8(d) << (unsigned) half;
+                letters |= (uint32_t) _mm_movemask_epi8(l) << (unsigned) half;
+                high |= (uint32_t) _mm_movemask_epi8(v) << (unsigned) half;
+            }
+            emit_runs(digits, letters, high, base, n, start, prev, carry_digit, carry_letter);
+        }
+        if (size > 0) {
+            runs.push_back(Segment{start, size - start, prev});
+        }
+    }
+#endif
+
+    SegmenterKernel kernel;
+    const unsigned char *table;
+    std::vector<Segment> runs;
+    int ascii_size = 0;
+};
+
+#endif //TRANSPCFG_SEGMENTER_H
@@ -0,0 +1,122 @@
+#ifndef TRANSPCFG_STRUCTURE_KEY_H
+#define TRANSPCFG_STRUCTURE_KEY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+
+/**
+ * character classes of the grammar. the low two bits are the class,
+ * CLASS_NON_ASCII marks bytes >= 128, they are specials but end the structure.
+ */
+enum CharClass {
+    CLASS_DIGIT = 0,
+    CLASS_LETTER = 1,
+    CLASS_SPECIAL = 2,
+    CLASS_MASK = 3,
+    CLASS_NON_ASCII = 4
+};
+
+/**
+ * the letter used for a class in structures, e.g. "LLLDD"
+ */
+inline char class_symbol(int cls) {
+    return "DLS"[cls];
+}
+
+/**
+ * a structure is keyed by its runs rather than by one letter per character.
+ * every byte of the key is one run: the class + 1 in the upper two bits, the length in the lower six.
+ * a run longer than 63 goes on in the next byte with the same class.
+ * for example, "LLLLLLDD" -> {0x86, 0x42}, so nearly every structure fits into 8 bytes
+ * and is hashed as a single 64-bit word.
+ */
+const int STRUCTURE_RUN_MAX = 63;
+
+inline void append_structure_run(std::string &key, int cls, int length) {
+    while (length > 0) {
+        int part = length > STRUCTURE_RUN_MAX ? STRUCTURE_RUN_MAX : length;
+        key += (char) (((cls + 1) << 6) | part);
+        length -= part;
+    }
+}
+
+/**
+ * call on_run(int cls, int length) for every run of the key, continued runs are joined.
+ * returns false if the key is malformed.
+ */
+template<class F>
+bool for_each_structure_run(const char *key, size_t size, F &&on_run) {
+    int cls = -1, length = 0;
+    for (size_t i = 0; i < size; i++) {
+        auto byte = (unsigned char) key[i];
+        int cur = (byte >> 6) - 1;
+        int part = byte & STRUCTURE_RUN_MAX;
+        if (cur < 0 || part == 0) {
+            return false;
+        }
+        if (cur == cls) {
+            length += part;
+            continue;
+        }
+        if (length > 0) {
+            on_run(cls, length);
+        }
+        cls = cur;
+        length = part;
+    }
+    if (length > 0) {
+        on_run(cls, length);
+    }
+    return true;
+}
+
+/**
+ * the text form used in structures.txt, e.g. "LLLLLLDD"
+ */
+inline std::string structure_text(const char *key, size_t size) {
+    std::string text;
+    for_each_structure_run(key, size, [&text](int cls, int length) {
+        text.append((size_t) length, class_symbol(cls));
+    });
+    return text;
+}
+
+/**
+ * grammar/structures.rle holds the structures of structures.txt, in the same order, with packed keys.
+ * native byte order: the magic, a uint64_t count, then per structure a double probability,
+ * a uint32_t key size and the key.
+ */
+const char STRUCTURE_FILE_MAGIC[8] = {'T', 'P', 'C', 'F', 'G', 'R', 'L', '1'};
+
+inline bool write_structure_header(std::FILE *file, uint64_t count) {
+    return std::fwrite(STRUCTURE_FILE_MAGIC, sizeof(STRUCTURE_FILE_MAGIC), 1, file) == 1
+           && std::fwrite(&count, sizeof(count), 1, file) == 1;
+}
+
+inline bool write_structure_record(std::FILE *file, double prob, const char *key, uint32_t size) {
+    return std::fwrite(&prob, sizeof(prob), 1, file) == 1
+           && std::fwrite(&size, sizeof(size), 1, file) == 1
+           && (size == 0 || std::fwrite(key, size, 1, file) == 1);
+}
+
+inline bool read_structure_header(std::FILE *file, uint64_t &count) {
+    char magic[sizeof(STRUCTURE_FILE_MAGIC)];
+    return std::fread(magic, sizeof(magic), 1, file) == 1
+           && std::equal(magic, magic + sizeof(magic), STRUCTURE_FILE_MAGIC)
+           && std::fread(&count, sizeof(count), 1, file) == 1;
+}
+
+inline bool read_structure_record(std::FILE *file, double &prob, std::string &key) {
+    uint32_t size;
+    if (std::fread(&prob, sizeof(prob), 1, file) != 1 || std::fread(&size, sizeof(size), 1, file) != 1) {
+        return false;
+    }
+    key.resize(size);
+    return size == 0 || std::fread(&key[0], size, 1, file) == 1;
+}
+
+#endif //TRANSPCFG_STRUCTURE_KEY_H
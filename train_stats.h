@@ -0,0 +1,369 @@
+#ifndef TRANSPCFG_TRAIN_STATS_H
+#define TRANSPCFG_TRAIN_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+
+/**
+ * cpu time of the whole process, all threads together
+ */
+inline double process_cpu_seconds() {
+#ifdef _WIN32
+    return (double) std::clock() / CLOCKS_PER_SEC;
+#else
+    timespec now{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+#endif
+}
+
+/**
+ * a "VmRSS:" or "VmHWM:" line of /proc/self/status in KB, -1 where there is none
+ */
+inline long long proc_status_kb(const char *field) {
+    long long kb = -1;
+#if defined(__linux__)
+    std::FILE *status = std::fopen("/proc/self/status", "r");
+    if (status == nullptr) {
+        return kb;
+    }
+    char line[256];
+    size_t n = strlen(field);
+    while (kb < 0 && std::fgets(line, sizeof(line), status) != nullptr) {
+        if (strncmp(line, field, n) == 0) {
+            kb = strtoll(line + n, nullptr, 10);
+        }
+    }
+    std::fclose(status);
+#else
+    (void) field;
+#endif
+    return kb;
+}
+
+/**
+ * the memory the process has resident now in KB, 0 where it is not known
+ */
+inline long long rss_kb() {
+    long long kb = proc_status_kb("VmRSS:");
+    return kb < 0 ? 0 : kb;
+}
+
+/**
+ * the most memory the process has had resident so far, in KB
+ */
+inline long long peak_rss_kb() {
+    long long kb = proc_status_kb("VmHWM:");
+    if (kb >= 0) {
+        return kb;
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+/**
+ * the steps of counting a line, timed on a sample of the lines
+ */
+enum CountingStep {
+    STEP_SPLIT = 0,
+    STEP_STRUCTURE,
+    STEP_SEGMENTS,
+    COUNTING_STEPS
+};
+
+/**
+ * what one train run spent its time and memory on: the phases one after the other, the counting steps,
+ * the training sets and the count tables. a background thread prints the progress to stderr.
+ * for example,
+ * TrainStats stats;
+ * stats.start_progress(10);
+ * { TrainStats::Phase phase(stats, "structures"); process_structure(); }
+ * stats.write_report("report.json");
+ */
+class TrainStats {
+public:
+    /**
+     * every SAMPLE_EVERY-th line of a thread is timed step by step,
+     * reading the clock around every step of every line would slow counting down
+     */
+    static const unsigned SAMPLE_EVERY = 256;
+
+    /**
+     * a phase lasts as long as this object
+     */
+    class Phase {
+    public:
+        Phase(TrainStats &stats, const std::string &name) : stats(stats) {
+            stats.begin_phase(name);
+        }
+
+        ~Phase() {
+            stats.end_phase();
+        }
+
+        Phase(const Phase &) = delete;
+
+        Phase &operator=(const Phase &) = delete;
+
+    private:
+        TrainStats &stats;
+    };
+
+    /**
+     * times the steps of one line if it is one of the sampled ones.
+     * for example,
+     * TrainStats::StepClock clock(stats);
+     * split(); clock.lap(STEP_SPLIT);
+     */
+    class StepClock {
+    public:
+        explicit StepClock(TrainStats &stats) : stats(stats) {
+            static thread_local unsigned lines = 0;
+            on = ++lines % SAMPLE_EVERY == 0;
+            if (on) {
+                last = std::chrono::steady_clock::now();
+            }
+        }
+
+        void lap(CountingStep step) {
+            if (on) {
+                auto now = std::chrono::steady_clock::now();
+                stats.step_ns[step] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+                last = now;
+            }
+        }
+
+    private:
+        TrainStats &stats;
+        bool on;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    TrainStats() : started(std::chrono::steady_clock::now()) {
+        for (auto &ns : step_ns) {
+            ns = 0;
+        }
+    }
+
+    ~TrainStats() {
+        stop_progress();
+    }
+
+    TrainStats(const TrainStats &) = delete;
+
+    TrainStats &operator=(const TrainStats &) = delete;
+
+    /**
+     * lines and bytes handed to the counters so far
+     */
+    void add_progress(long long new_lines, long long new_bytes) {
+        lines += new_lines;
+        bytes += new_bytes;
+    }
+
+    /**
+     * time spent waiting for the next block of a training set
+     */
+    void add_read_time(std::chrono::steady_clock::duration spent) {
+        read_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count();
+    }
+
+    void add_source(const std::string &path, double weight, long long source_lines, long long source_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sources.push_back(SourceStats{path, weight, source_lines, source_bytes});
+    }
+
+    /**
+     * distinct keys of a table and the most bytes it took in memory at once
+     */
+    void add_table(const std::string &source, const std::string &name, long long keys, long long memory_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tables.push_back(TableStats{source, name, keys, memory_bytes});
+    }
+
+    /**
+     * print the progress to stderr every interval seconds until stop_progress, 0 prints nothing
+     */
+    void start_progress(double interval) {
+        if (interval <= 0 || reporter.joinable()) {
+            return;
+        }
+        reporter = std::thread([this, interval]() {
+            auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(interval));
+            long long last_lines = 0, last_bytes = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping) {
+                if (wake.wait_for(lock, period, [this]() { return stopping; })) {
+                    break;
+                }
+                long long now_lines = lines, now_bytes = bytes;
+                double elapsed = seconds_since(started);
+                std::fprintf(stderr, "[Progress]: %.0f s, %s, %lld lines (%.0f/s), %.1f MB (%.1f MB/s), "
+                                     "RSS %lld MB\n", elapsed, phase_name.c_str(), now_lines,
+                             (double) (now_lines - last_lines) / interval, (double) now_bytes / (1 << 20),
+                             (double) (now_bytes - last_bytes) / (1 << 20) / interval, rss_kb() / 1024);
+                last_lines = now_lines;
+                last_bytes = now_bytes;
+            }
+        });
+    }
+
+    void stop_progress() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (reporter.joinable()) {
+            reporter.join();
+        }
+    }
+
+    /**
+     * everything measured as one JSON object, false if it could not be written
+     */
+    bool write_report(const std::string &path, int threads) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::FILE *out = std::fopen(path.c_str(), "w");
+        if (out == nullptr) {
+            return false;
+        }
+        double wall = seconds_since(started);
+        long long peak = peak_rss_kb();
+        std::fprintf(out, "{\n  \"threads\": %d,\n  \"wall_seconds\": %.3f,\n  \"cpu_seconds\": %.3f,\n", threads,
+                     wall, process_cpu_seconds());
+        std::fprintf(out, "  \"peak_rss_kb\": %lld,\n  \"lines\": %lld,\n  \"bytes\": %lld,\n", peak,
+                     (long long) lines, (long long) bytes);
+        std::fprintf(out, "  \"training_sets\": [");
+        for (size_t i = 0; i < sources.size(); i++) {
+            const SourceStats &source = sources[i];
+            std::fprintf(out, "%s\n    {\"path\": \"%s\", \"weight\": %g, \"lines\": %lld, \"bytes\": %lld}",
+                         i == 0 ? "" : ",", json_escape(source.path).c_str(), source.weight, source.lines,
+                         source.bytes);
+        }
+        std::fprintf(out, "\n  ],\n  \"phases\": [");
+        for (size_t i = 0; i < phases.size(); i++) {
+            const PhaseStats &phase = phases[i];
+            std::fprintf(out, "%s\n    {\"name\": \"%s\", \"wall_seconds\": %.3f, \"cpu_seconds\": %.3f, "
+                              "\"rss_kb\": %lld, \"peak_rss_kb\": %lld}", i == 0 ? "" : ",",
+                         json_escape(phase.name).c_str(), phase.wall, phase.cpu, phase.rss_kb, phase.peak_rss_kb);
+        }
+        // the steps are estimated from the sampled lines, in cpu seconds of all counting threads together
+        const char *steps[] = {"split", "structure", "segments"};
+        std::fprintf(out, "\n  ],\n  \"counting\": {\n    \"read_seconds\": %.3f", (double) read_ns / 1e9);
+        for (int step = 0; step < COUNTING_STEPS; step++) {
+            std::fprintf(out, ",\n    \"%s_seconds\": %.3f", steps[step],
+                         (double) step_ns[step] * SAMPLE_EVERY / 1e9);
+        }
+        std::fprintf(out, "\n  },\n  \"tables\": [");
+        for (size_t i = 0; i < tables.size(); i++) {
+            const TableStats &table = tables[i];
+            std::fprintf(out, "%s\n    {\"training_set\": \"%s\", \"name\": \"%s\", \"distinct_keys\": %lld, "
+                              "\"peak_bytes\": %lld}", i == 0 ? "" : ",", json_escape(table.source).c_str(),
+                         json_escape(table.name).c_str(), table.keys, table.memory_bytes);
+        }
+        std::fprintf(out, "\n  ]\n}\n");
+        return std::fclose(out) == 0;
+    }
+
+private:
+    struct PhaseStats {
+        std::string name;
+        double wall;
+        double cpu;
+        // resident at the end of the phase and the most so far: the phase that raised the peak is the one to look at
+        long long rss_kb;
+        long long peak_rss_kb;
+    };
+
+    struct SourceStats {
+        std::string path;
+        double weight;
+        long long lines;
+        long long bytes;
+    };
+
+    struct TableStats {
+        std::string source;
+        std::string name;
+        long long keys;
+        long long memory_bytes;
+    };
+
+    void begin_phase(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        phase_name = name;
+        phase_started = std::chrono::steady_clock::now();
+        phase_cpu = process_cpu_seconds();
+    }
+
+    void end_phase() {
+        std::lock_guard<std::mutex> lock(mutex);
+        phases.push_back(PhaseStats{phase_name, seconds_since(phase_started), process_cpu_seconds() - phase_cpu,
+                                    rss_kb(), peak_rss_kb()});
+        phase_name = "between phases";
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static std::string json_escape(const std::string &text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if ((unsigned char) c < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", (unsigned) c);
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::atomic<long long> lines{0};
+    std::atomic<long long> bytes{0};
+    std::atomic<long long> read_ns{0};
+    std::atomic<long long> step_ns[COUNTING_STEPS];
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point phase_started;
+    double phase_cpu = 0;
+    std::string phase_name = "starting";
+    std::vector<PhaseStats> phases;
+    std::vector<SourceStats> sources;
+    std::vector<TableStats> tables;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread reporter;
+    bool stopping = false;
+};
+
+#endif //TRANSPCFG_TRAIN_STATS_H
@@ -15,11 +15,22 @@
 #include <deque>
 #include <list>
 #include <queue>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "structure_key.h"
+#include "model_file.h"
+#include "guess_queue.h"
+#include "guess_writer.h"
 
 //using namespace std;
 
 #define MAXWORDSIZE 20 //Maximum size of a word from the input dictionaries
 #define MAXINPUTDIC 1  //Maximum number of user inputed dictionaries
+#define EXPANSIONCHUNK 65536  //combinations of a pre-terminal expanded by one task, larger ones are split
+#define TASKSPERTHREAD 4  //tasks handed out ahead of the one being written
 
 #ifdef _WIN32
 #define PATH_DELIMITER '\\'
@@ -30,6 +41,7 @@
 //declare variables in config file
 std::string model_path, guesses_file;
 long guess_number, password_max_len, password_min_len;
+int guess_threads = 1;
 
 
 ///////////////////////////////////////////
@@ -44,47 +56,70 @@ typedef struct {
 
 ///////////////////////////////////////////
 //Non-Terminal Container Struct
-//Holds all the base information used for non-terminal to terminal replacements
+//A group of the text model while it is read, the replacement values can be dictionary words, digits or specials.
+//The words are back to back, word i is wordPool[wordOffsets[i], wordOffsets[i + 1]).
+//The groups of model.bin go straight into the queue
 typedef struct ntContainerStruct {
     double probability{};    //the probability of this group
-    std::list<std::string> word;           //the replacement value, can be a dictionary word, a
+    std::string wordPool;
+    std::vector<uint64_t> wordOffsets;
     ntContainerStruct *next{};        //The next highest probable replacement for this type
+    uint32_t id{};    //its number in the queue
 } ntContainerType;
 
 //////////////////////////////////////////
-//PriorityQueue Replacement Type
-//Basically a pointer
-typedef struct pqReplacementStruct {
-    int pivotPoint{};
-    double probability{};
-    double base_probability{};  //the probability of the base structure
-    std::deque<ntContainerType *> replacement;
-} pqReplacementType;
+//Structure Holder Type
+//A structure while it is read, before it goes into the queue
+typedef struct structureHolderStruct {
+    double probability{};  //the probability of the base structure
+    std::vector<uint32_t> replacement;  //the numbers of its groups
+} structureHolderType;
 
-std::ofstream output_password;
+//////////////////////////////////////////
+//Expansion Task
+//The combinations first to last - 1 of a popped pre-terminal, expanded into a buffer of their own.
+//The tasks are written in the order they were popped, so the guesses keep the order of the queue
+typedef struct expansionTaskStruct {
+    GuessQueue::PreTerminal preTerminal;
+    unsigned long long first{};
+    unsigned long long last{};
+    std::string output;  //the guesses, one per line
+    unsigned long long guesses{};
+    bool done{};
+} expansionTaskType;
+
+//the guesses are written on a thread of their own, --guesses-file - writes them to stdout
+GuessWriter output_password;
 
 unsigned long long count = 0;
 
+//the tasks waiting for a worker, the coordinator (generateGuesses) adds them in pop order
+std::deque<expansionTaskType *> pendingTasks;
+std::mutex taskMutex;
+std::condition_variable taskReady;
+std::condition_variable taskDone;
+bool stopWorkers = false;
 
-class queueOrder {
-public:
-    queueOrder() = default;
 
-    bool operator()(const pqReplacementType &lhs, const pqReplacementType &rhs) const {
-        return (lhs.probability < rhs.probability);
-    }
-};
+bool processBasicStruct(GuessQueue *pQueue, ntContainerType **dicWords, ntContainerType **numWords,
+                        ntContainerType **specialWords);
 
-typedef std::priority_queue<pqReplacementType, std::vector<pqReplacementType>, queueOrder> pqueueType;
+bool addReplacement(structureHolderType *inputValue, char pastCase, int curSize, ntContainerType **dicWords,
+                    ntContainerType **numWords, ntContainerType **specialWords);
 
-bool processBasicStruct(pqueueType *pQueue, ntContainerType **dicWords, ntContainerType **numWords,
-                        ntContainerType **specialWords);
+bool pushStructure(GuessQueue *pQueue, structureHolderType *inputValue);
 
-bool generateGuesses(pqueueType *pQueue);
+void addWord(ntContainerType *container, const char *word, size_t wordSize);
 
-int createTerminal(pqReplacementType *curQueueItem, int workingSection, std::string *curOutput, double prob);
+void numberGroups(GuessQueue *pQueue, ntContainerType **mainContainer);
 
-bool pushNewValues(pqueueType *pQueue, pqReplacementType *curQueueItem);
+bool generateGuesses(GuessQueue *pQueue);
+
+void expansionWorker();
+
+bool commitGuesses(const expansionTaskType *task);
+
+void createTerminal(expansionTaskType *task);
 
 void help();  //prints out the usage info
 
@@ -92,27 +127,24 @@ void help();  //prints out the usage info
 bool processDic(std::string *inputDicFileName, const double *inputDicProb, ntContainerType **dicWords);
 
 bool processProbFromFile(ntContainerType **mainContainer, char *fileType);  //processes the number probabilities
+
+int addPackedStructure(GuessQueue *pQueue, double prob, const char *key, size_t keySize, ntContainerType **dicWords,
+                       ntContainerType **numWords, ntContainerType **specialWords);
+
+bool processTextModel(ntContainerType **dicWords, ntContainerType **numWords, ntContainerType **specialWords,
+                      GuessQueue *pQueue);
 //used to find the length of a possible non-ascii string, used because MACOSX had problems with wstring
 short findSize(std::string input);
 
 
 int main(int argc, char *argv[]) {
-    std::string inputDicFileName[MAXINPUTDIC];
-
-    double inputDicProb[MAXINPUTDIC];
-
     ntContainerType *dicWords[MAXWORDSIZE];
     ntContainerType *numWords[MAXWORDSIZE];
     ntContainerType *specialWords[MAXWORDSIZE];
 
-    pqueueType pqueue;
+    GuessQueue pqueue;
 //---------Parse the command line------------------------//
 
-    //--Initilize the command line variables -- //
-    for (double &i : inputDicProb) {
-        i = 1;
-    }
-
     if (argc == 1) {
         help();
     }
@@ -123,6 +155,9 @@ int main(int argc, char *argv[]) {
     std::string _guess_min_len = "--guess-min-len";
     std::string _guess_max_len = "--guess-max-len";
     std::string _verbose = "--with-prob";
+    std::string _text_model = "--text-model";
+    std::string _threads = "--threads";
+    bool textModel = false;
     for (int i = 1; i < argc; i++) {
         if (strncmp(argv[i], _help.c_str(), _help.length()) == 0) {
             help();
@@ -145,6 +180,11 @@ int main(int argc, char *argv[]) {
         } else if (strncmp(argv[i], _guess_max_len.c_str(), _guess_max_len.length()) == 0) {
             i += 1;
             password_max_len = strtol(argv[i], nullptr, 0);
+        } else if (strncmp(argv[i], _text_model.c_str(), _text_model.length()) == 0) {
+            textModel = true;
+        } else if (strncmp(argv[i], _threads.c_str(), _threads.length()) == 0) {
+            i += 1;
+            guess_threads = (int) strtol(argv[i], nullptr, 0);
         }
 
     }
@@ -154,17 +194,54 @@ int main(int argc, char *argv[]) {
         std::cerr << "Error: min length cannot larger than max length!" << std::endl;
         return -1;
     }
+    if (guess_threads < 1) {
+        std::cerr << "Error: number of threads should be at least 1!" << std::endl;
+        return -1;
+    }
 
     //---------Process all the Dictioanry Words------------------//
     if (model_path.empty()) {
         std::cout << "Need trained model" << std::endl;
         std::exit(-1);
     }
+    //---------The binary model is used in place, no parsing------------------//
+    ModelFile binaryModel;
+    if (!textModel && binaryModel.open(model_path + "model.bin")) {
+        if (!pqueue.load(binaryModel)) {
+            std::cerr << "\nError, could not use the structures of " << model_path << "model.bin\n";
+            return 0;
+        }
+        //the groups use the words of the model in place, it stays open until the guesses are made
+    } else if (!processTextModel(dicWords, numWords, specialWords, &pqueue)) {
+        return 0;
+    }
+
+    if (!guesses_file.empty() && !output_password.open(guesses_file)) {
+        std::cerr << "Error: could not open " << guesses_file << std::endl;
+        return -1;
+    }
+    if (!generateGuesses(&pqueue)) {
+        std::cerr << (pqueue.failed() ? "\nError, the words of a group lie outside the model\n"
+                                      : "\nError generating guesses\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+//reads the text model: dictionary.txt, the digits and special files and the structures
+bool processTextModel(ntContainerType **dicWords, ntContainerType **numWords, ntContainerType **specialWords,
+                      GuessQueue *pQueue) {
+    std::string inputDicFileName[MAXINPUTDIC];
+    double inputDicProb[MAXINPUTDIC];
+    for (double &i : inputDicProb) {
+        i = 1;
+    }
     inputDicFileName[0] = model_path + "dictionary.txt";
     if (!processDic(inputDicFileName, inputDicProb, dicWords)) {
         std::cerr << "\nThere was a problem opening the input dictionaries\n";
         help();
-        return 0;
+        return false;
     }
 
 #ifdef _WIN32
@@ -173,7 +250,7 @@ int main(int argc, char *argv[]) {
     if (!processProbFromFile(numWords, (char *) "model/digits/")) {
 #endif
         std::cerr << "\nCould not open the number probability files\n";
-        return 0;
+        return false;
     }
 #ifdef _WIN32
     if (processProbFromFile(specialWords,"model\\special\\")==false) {
@@ -181,29 +258,27 @@ int main(int argc, char *argv[]) {
     if (!processProbFromFile(specialWords, (char *) "model/special/")) {
 #endif
         std::cerr << "\nCould not open the special character probability files\n";
-        return 0;
+        return false;
     }
-    if (!processBasicStruct(&pqueue, dicWords, numWords, specialWords)) {
+    numberGroups(pQueue, dicWords);
+    numberGroups(pQueue, numWords);
+    numberGroups(pQueue, specialWords);
+    if (!processBasicStruct(pQueue, dicWords, numWords, specialWords)) {
         std::cerr << "\nError, could not open structure file from the training set\n";
-        return 0;
-    }
-
-    output_password.open(guesses_file.c_str());
-    if (!generateGuesses(&pqueue)) {
-        std::cerr << "\nError generating guesses\n";
-        return 0;
+        return false;
     }
-
-    return 0;
+    return true;
 }
 
 
 void help() {
     std::cout << "Usage Info:\n"
-                 "--guesses-file\tpwd generated will be placed here\n"
+                 "--guesses-file\tpwd generated will be placed here, - is stdout, a named pipe works too\n"
                  "--guess-number\tnumber of pwd to be generated\n"
                  "--guess-min-len\tpwd with length shorter than this will be ignored\n"
-                 "--guess-max-len\tpwd with length longer than this will be ignored" << std::endl;
+                 "--guess-max-len\tpwd with length longer than this will be ignored\n"
+                 "--text-model\tread the text model even if model.bin exists\n"
+                 "--threads\tnumber of threads making the guesses, they are written in the same order" << std::endl;
     std::exit(-1);
 }
 
@@ -323,7 +398,7 @@ bool processDic(std::string *inputDicFileName, const double *inputDicProb, ntCon
             std::cerr << "Word " << (*it).word << " prob " << (*it).probability << std::endl;
             return false;
         }
-        tempContainer->word.push_back((*it).word);
+        addWord(tempContainer, (*it).word.data(), (*it).word.size());
     }
 
 
@@ -347,7 +422,6 @@ short findSize(
 bool processProbFromFile(ntContainerType **mainContainer, char *type) {  //processes the number probabilities
     bool atLeastOneValue = false;
     std::ifstream inputFile;
-    std::list<std::string>::iterator it;
     char fileName[256];
     ntContainerType *curContainer;
     std::string inputLine;
@@ -367,16 +441,17 @@ bool processProbFromFile(ntContainerType **mainContainer, char *type) {  //proce
                 getline(inputFile, inputLine);
                 marker = inputLine.find('\t');
                 if (marker != std::string::npos) {
-                    prob = strtod(inputLine.substr(marker + 1, inputLine.size()).c_str(), nullptr);
+                    // the probabilities are floats, written either in full or as their shortest form
+                    prob = strtof(inputLine.substr(marker + 1, inputLine.size()).c_str(), nullptr);
                     if ((curContainer->probability == 0) || (curContainer->probability == prob)) {
                         curContainer->probability = prob;
-                        curContainer->word.push_back(inputLine.substr(0, marker));
+                        addWord(curContainer, inputLine.data(), marker);
                     } else {
                         curContainer->next = new ntContainerType;
                         curContainer = curContainer->next;
                         curContainer->next = nullptr;
                         curContainer->probability = prob;
-                        curContainer->word.push_back(inputLine.substr(0, marker));
+                        addWord(curContainer, inputLine.data(), marker);
                     }
                 }
             }
@@ -394,29 +469,59 @@ bool processProbFromFile(ntContainerType **mainContainer, char *type) {  //proce
 }
 
 
-bool processBasicStruct(pqueueType *pQueue, ntContainerType **dicWords, ntContainerType **numWords,
+bool processBasicStruct(GuessQueue *pQueue, ntContainerType **dicWords, ntContainerType **numWords,
                         ntContainerType **specialWords) {
     std::ifstream inputFile;
     std::string inputLine;
     size_t marker;
     double prob;
-    pqReplacementType inputValue;
+    structureHolderType inputValue;
     char pastCase;
     int curSize = 0;
     bool badInput;
 #ifdef _WIN32
+    std::string rleFile = ".\\" + model_path + "model\\grammar\\structures.rle";
     std::string file = ".\\" + model_path + "model\\grammar\\structures.txt";
-      inputFile.open(file.c_str());
 #else
+    std::string rleFile = model_path + "model/grammar/structures.rle";
     std::string file = model_path + "model/grammar/structures.txt";
-    inputFile.open(file.c_str());
 #endif
 
+    //--packed structures, the runs are decoded straight from the keys--//
+    std::FILE *packedFile = fopen(rleFile.c_str(), "rb");
+    if (packedFile != nullptr) {
+        uint64_t numStructures;
+        if (!read_structure_header(packedFile, numStructures)) {
+            std::cerr << "Broken structure file " << rleFile << std::endl;
+            fclose(packedFile);
+            return false;
+        }
+        for (uint64_t n = 0; n < numStructures; n++) {
+            if (!read_structure_record(packedFile, prob, inputLine)) {
+                std::cerr << "Broken structure file " << rleFile << std::endl;
+                fclose(packedFile);
+                return false;
+            }
+            int status = addPackedStructure(pQueue, prob, inputLine.data(), inputLine.size(),
+                                            dicWords, numWords, specialWords);
+            if (status == 0) {
+                std::cerr << "Broken structure file " << rleFile << std::endl;
+            }
+            if (status != 1) {
+                fclose(packedFile);
+                return false;
+            }
+        }
+        fclose(packedFile);
+        return true;
+    }
+
+    //--text structures, e.g. "LLLLDD\t0.01"--//
+    inputFile.open(file.c_str());
     if (!inputFile.is_open()) {
         std::cerr << "Could not open the grammar file" << file << std::endl;
         return false;
     }
-    inputValue.pivotPoint = 0;
     while (!inputFile.eof()) {
         badInput = false;
         getline(inputFile, inputLine);
@@ -425,7 +530,7 @@ bool processBasicStruct(pqueueType *pQueue, ntContainerType **dicWords, ntContai
             prob = strtod(inputLine.substr(marker + 1, inputLine.size()).c_str(), nullptr);
             inputLine.resize(marker);
             inputValue.probability = prob;
-            inputValue.base_probability = prob;
+            inputValue.replacement.clear();
             pastCase = '!';
             curSize = 0;
             for (char i : inputLine) {
@@ -439,69 +544,24 @@ bool processBasicStruct(pqueueType *pQueue, ntContainerType **dicWords, ntContai
                 } else if (pastCase == i) {
                     curSize++;
                 } else {
-                    if (pastCase == 'L') {
-                        if (dicWords[curSize] == nullptr) {
-                            badInput = true;
-                            break;
-                        }
-                        inputValue.replacement.push_back(dicWords[curSize]);
-                        inputValue.probability = inputValue.probability * dicWords[curSize]->probability;
-                    } else if (pastCase == 'D') {
-                        if (numWords[curSize] == nullptr) {
-                            badInput = true;
-                            break;
-                        }
-                        inputValue.replacement.push_back(numWords[curSize]);
-                        inputValue.probability = inputValue.probability * numWords[curSize]->probability;
-                    } else if (pastCase == 'S') {
-                        if (specialWords[curSize] == nullptr) {
-                            badInput = true;
-                            break;
-                        }
-                        inputValue.replacement.push_back(specialWords[curSize]);
-                        inputValue.probability = inputValue.probability * specialWords[curSize]->probability;
-                    } else {
+                    if (pastCase != 'L' && pastCase != 'D' && pastCase != 'S') {
                         std::cerr << "WTF Weird Error Occurred\n";
                         return false;
                     }
+                    if (!addReplacement(&inputValue, pastCase, curSize, dicWords, numWords, specialWords)) {
+                        badInput = true;
+                        break;
+                    }
                     curSize = 1;
                     pastCase = i;
                 }
             }
-            if (badInput) { //NOOP
-            } else if (pastCase == 'L') {
-                if ((curSize >= MAXWORDSIZE) || (dicWords[curSize] == nullptr)) {
-                    badInput = true;
-                } else {
-                    inputValue.replacement.push_back(dicWords[curSize]);
-                    inputValue.probability = inputValue.probability * dicWords[curSize]->probability;
-                }
-            } else if (pastCase == 'D') {
-                if ((curSize >= MAXWORDSIZE) || (numWords[curSize] == nullptr)) {
-                    badInput = true;
-                } else {
-                    inputValue.replacement.push_back(numWords[curSize]);
-                    inputValue.probability = inputValue.probability * numWords[curSize]->probability;
-                }
-            } else if (pastCase == 'S') {
-                if ((curSize >= MAXWORDSIZE) || (specialWords[curSize] == nullptr)) {
-                    badInput = true;
-                } else {
-                    inputValue.replacement.push_back(specialWords[curSize]);
-                    inputValue.probability = inputValue.probability * specialWords[curSize]->probability;
-                }
+            if (!badInput && pastCase != '!') {
+                badInput = !addReplacement(&inputValue, pastCase, curSize, dicWords, numWords, specialWords);
             }
-            if (!badInput) {
-                if (inputValue.probability == 0) {
-                    std::cerr << "Error, we are getting some values with 0 probability\n";
-                    return false;
-                }
-                pQueue->push(inputValue);
+            if (!badInput && !pushStructure(pQueue, &inputValue)) {
+                return false;
             }
-
-
-            inputValue.probability = 0;
-            inputValue.replacement.clear();
         }
     }
 
@@ -509,79 +569,207 @@ bool processBasicStruct(pqueueType *pQueue, ntContainerType **dicWords, ntContai
     return true;
 }
 
+//pushes the structure with a packed key (see structure_key.h)
+//returns 1 if it was used or skipped, 0 if the key is malformed, -1 on an error
+int addPackedStructure(GuessQueue *pQueue, double prob, const char *key, size_t keySize, ntContainerType **dicWords,
+                       ntContainerType **numWords, ntContainerType **specialWords) {
+    structureHolderType inputValue;
+    inputValue.probability = prob;
+    bool badInput = false;
+    bool wellFormed = for_each_structure_run(key, keySize, [&](int cls, int size) {
+        badInput = badInput || !addReplacement(&inputValue, class_symbol(cls), size, dicWords, numWords, specialWords);
+    });
+    if (!wellFormed) {
+        return 0;
+    }
+    if (!badInput && !pushStructure(pQueue, &inputValue)) {
+        return -1;
+    }
+    return 1;
+}
+
+//appends the most probable group for a run of curSize characters of type pastCase ('L', 'D' or 'S')
+//returns false if the model has no such group, the structure can't be used then
+bool addReplacement(structureHolderType *inputValue, char pastCase, int curSize, ntContainerType **dicWords,
+                    ntContainerType **numWords, ntContainerType **specialWords) {
+    ntContainerType **words;
+    if (pastCase == 'L') {
+        words = dicWords;
+    } else if (pastCase == 'D') {
+        words = numWords;
+    } else if (pastCase == 'S') {
+        words = specialWords;
+    } else {
+        return false;
+    }
+    if ((curSize >= MAXWORDSIZE) || (words[curSize] == nullptr)) {
+        return false;
+    }
+    inputValue->replacement.push_back(words[curSize]->id);
+    return true;
+}
 
-bool generateGuesses(pqueueType *pQueue) {
-    pqReplacementType curQueueItem;
-    int returnStatus;
-    std::string curGuess;
-    while (!pQueue->empty()) {
-        curQueueItem = pQueue->top();
-        pQueue->pop();
-        curGuess.clear();
-        returnStatus = createTerminal(&curQueueItem, 0, &curGuess, curQueueItem.base_probability);
-        if (returnStatus == 1) { //made the maximum number of guesses
-            return true;
-        } else if (returnStatus == -1) { //an error occured
-            return false;
-        }
-        pushNewValues(pQueue, &curQueueItem);
+bool pushStructure(GuessQueue *pQueue, structureHolderType *inputValue) {
+    if (!pQueue->add_structure(inputValue->probability, inputValue->replacement.data(),
+                               inputValue->replacement.size())) {
+        std::cerr << "Error, a structure has 0 probability or too many sections\n";
+        return false;
     }
     return true;
 }
 
+//appends a word of the text model to its group
+void addWord(ntContainerType *container, const char *word, size_t wordSize) {
+    if (container->wordOffsets.empty()) {
+        container->wordOffsets.push_back(0);
+    }
+    container->wordPool.append(word, wordSize);
+    container->wordOffsets.push_back(container->wordPool.size());
+}
 
-int createTerminal(pqReplacementType *curQueueItem, int workingSection, std::string *curOutput, double curProb) {
-    std::list<std::string>::iterator it;
-    int size = curOutput->size();
-    curProb *= curQueueItem->replacement[workingSection]->probability;
-    for (it = curQueueItem->replacement[workingSection]->word.begin();
-         it != curQueueItem->replacement[workingSection]->word.end(); ++it) {
-        curOutput->resize(size);
-        curOutput->append(*it);
-        if (workingSection == curQueueItem->replacement.size() - 1) {
-            if ((curOutput->size() >= password_min_len) &&
-                (curOutput->size() <= password_max_len)) {
-                count++;
-                if (!guesses_file.empty() && count <= guess_number) {
-                    output_password << *curOutput << '\n';
-                } else {
-                    output_password.flush();
-                    output_password.close();
-                    std::exit(0);
+//adds the groups of one kind of terminal to the queue once all their words are there, their words stay here
+void numberGroups(GuessQueue *pQueue, ntContainerType **mainContainer) {
+    for (int i = 0; i < MAXWORDSIZE; i++) {
+        uint32_t previous = GuessQueue::NONE;
+        for (ntContainerType *curContainer = mainContainer[i]; curContainer != nullptr;
+             curContainer = curContainer->next) {
+            curContainer->wordOffsets.resize(std::max(curContainer->wordOffsets.size(), (size_t) 1), 0);
+            curContainer->id = pQueue->add_group(curContainer->probability, curContainer->wordPool.data(),
+                                                 curContainer->wordPool.size(), curContainer->wordOffsets.data(),
+                                                 curContainer->wordOffsets.size() - 1, previous);
+            previous = curContainer->id;
+        }
+    }
+}
+
+
+//pops the pre-terminals in probability order and cuts them into tasks of at most EXPANSIONCHUNK combinations.
+//with more than one thread the tasks are expanded by the workers while the coordinator keeps the queue going,
+//a large pre-terminal is spread over all of them. the tasks are written one after the other in pop order
+bool generateGuesses(GuessQueue *pQueue) {
+    GuessQueue::PreTerminal curPreTerminal;
+    unsigned long long nextCombination = 0;
+    unsigned long long numCombinations = 0;
+    std::deque<expansionTaskType *> window;
+    //the tasks that are written, they are used again with the buffers they have
+    std::vector<expansionTaskType *> freeTasks;
+    std::vector<std::thread> workers;
+    size_t maxWindow = 1;
+    if (guess_threads > 1) {
+        maxWindow = TASKSPERTHREAD * (size_t) guess_threads;
+        for (int i = 0; i < guess_threads; i++) {
+            workers.emplace_back(expansionWorker);
+        }
+    }
+    while (true) {
+        while (window.size() < maxWindow) {
+            if (nextCombination == numCombinations) {
+                if (!pQueue->pop(curPreTerminal)) {
+                    break;
                 }
+                numCombinations = curPreTerminal.combinations;
+                nextCombination = 0;
+            }
+            expansionTaskType *task;
+            if (freeTasks.empty()) {
+                task = new expansionTaskType;
             } else {
-                return 0;
+                task = freeTasks.back();
+                freeTasks.pop_back();
+                task->output.clear();
+                task->guesses = 0;
+                task->done = false;
             }
-
-
+            task->preTerminal = curPreTerminal;
+            task->first = nextCombination;
+            task->last = std::min(nextCombination + EXPANSIONCHUNK, numCombinations);
+            nextCombination = task->last;
+            window.push_back(task);
+            if (!workers.empty()) {
+                std::lock_guard<std::mutex> lock(taskMutex);
+                pendingTasks.push_back(task);
+                taskReady.notify_one();
+            }
+        }
+        if (window.empty()) {
+            break;
+        }
+        expansionTaskType *task = window.front();
+        window.pop_front();
+        if (workers.empty()) {
+            createTerminal(task);
         } else {
-            createTerminal(curQueueItem, workingSection + 1, curOutput, curProb);
+            std::unique_lock<std::mutex> lock(taskMutex);
+            taskDone.wait(lock, [task] { return task->done; });
+        }
+        bool more = commitGuesses(task);
+        freeTasks.push_back(task);
+        if (!more) { //made the maximum number of guesses
+            break;
         }
     }
+    {
+        std::lock_guard<std::mutex> lock(taskMutex);
+        stopWorkers = true;
+        pendingTasks.clear();
+        taskReady.notify_all();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (auto &task : window) {
+        delete task;
+    }
+    for (auto &task : freeTasks) {
+        delete task;
+    }
+    //false if the guesses could not all be written, a pipe whose reader is gone for example
+    //or if the queue stopped at a group whose words lie outside the model
+    return output_password.close() && !pQueue->failed();
+}
 
-    return 0;
+//expands the tasks handed out by generateGuesses until it stops them
+void expansionWorker() {
+    std::unique_lock<std::mutex> lock(taskMutex);
+    while (true) {
+        taskReady.wait(lock, [] { return stopWorkers || !pendingTasks.empty(); });
+        if (stopWorkers) {
+            return;
+        }
+        expansionTaskType *task = pendingTasks.front();
+        pendingTasks.pop_front();
+        lock.unlock();
+        createTerminal(task);
+        lock.lock();
+        task->done = true;
+        taskDone.notify_all();
+    }
 }
 
-bool pushNewValues(pqueueType *pQueue, pqReplacementType *curQueueItem) {
-    pqReplacementType insertValue;
-
-    insertValue.base_probability = curQueueItem->base_probability;
-    for (int i = curQueueItem->pivotPoint; (unsigned long) i < curQueueItem->replacement.size(); i++) {
-        if (curQueueItem->replacement[i]->next != nullptr) {
-            insertValue.pivotPoint = i;
-            insertValue.replacement.clear();
-            insertValue.probability = curQueueItem->base_probability;
-            for (int j = 0; (unsigned long) j < curQueueItem->replacement.size(); j++) {
-                if (j != i) {
-                    insertValue.replacement.push_back(curQueueItem->replacement[j]);
-                    insertValue.probability = insertValue.probability * curQueueItem->replacement[j]->probability;
-                } else {
-                    insertValue.replacement.push_back(curQueueItem->replacement[j]->next);
-                    insertValue.probability = insertValue.probability * curQueueItem->replacement[j]->next->probability;
-                }
-            }
-            pQueue->push(insertValue);
+//writes the guesses of a task, returns false once guess_number guesses are made
+bool commitGuesses(const expansionTaskType *task) {
+    if (guesses_file.empty() || guess_number <= 0) {
+        return false;
+    }
+    unsigned long long left = (unsigned long long) guess_number - count;
+    size_t size = task->output.size();
+    if (task->guesses >= left) {
+        //cut after the last guess that is still wanted
+        size = 0;
+        for (unsigned long long i = 0; i < left; i++) {
+            size = (const char *) memchr(task->output.data() + size, '\n', task->output.size() - size)
+                   - task->output.data() + 1;
         }
     }
-    return true;
+    if (!output_password.write(task->output.data(), size)) {
+        return false;
+    }
+    count += std::min(task->guesses, left);
+    return count < (unsigned long long) guess_number;
+}
+
+//appends the guesses of the combinations task->first to task->last - 1 to task->output
+void createTerminal(expansionTaskType *task) {
+    GuessQueue::expand(task->preTerminal, task->first, task->last, password_min_len, password_max_len, task->output,
+                       task->guesses);
 }
@@ -7,12 +7,24 @@
 #include <fstream>
 #include <deque>
 #include <queue>
-#include <map>
 #include <algorithm>
 #include <sys/stat.h>
 #include <utility>
 #include <dirent.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "include/clipp.h"
+#include "corpus_reader.h"
+#include "segmenter.h"
+#include "count_table.h"
+#include "count_runs.h"
+#include "heavy_hitters.h"
+#include "model_file.h"
+#include "model_writer.h"
+#include "train_stats.h"
+#include "guess_queue.h"
 
 
 #ifdef _WIN32
@@ -36,77 +48,266 @@ public:;
         return str;
     }
 
-    int getCnt() {
+    long long getCnt() {
         return cnt;
     }
 
 protected:
     std::string str;
-    int cnt;
+    long long cnt;
 };
 
 
 /**
  * keep the structure of the passwords, and the frequency of the structure.
+ * the structure is built from its packed key (see structure_key.h).
  * for example, 
- * Structure *s = new Structure("LLL", 4);
+ * Structure *s = new Structure(std::string(1, (char) 0x83), 4, 0.1);  // "LLL"
  */
 class Structure : public Entry {
 public:
-    Structure(std::string data, int count) {
-        str = std::move(data);
+    Structure(std::string packed_key, long long count, double probability) {
+        key = std::move(packed_key);
+        str = structure_text(key.data(), key.size());
         cnt = count;
+        prob = probability;
     };
+
+    std::string getKey() {
+        return key;
+    }
+
+    double getProb() {
+        return prob;
+    }
+
+protected:
+    std::string key;
+    double prob;
 };
 
 /**
- * keep the digit part of the passwords, and the frequency of the digit.
- * for example, 
- * Digit *s = new Digit("1234", 0.4);
+ * the digits or specials of one length with their smoothed probabilities.
+ * the keys are kept back to back in one pool, keys[i] refers to pool[offset, offset + length).
+ * for example,
+ * LengthBucket four;  // "1234" 0.4, "2019" 0.1
+ */
+struct SmoothedKey {
+    uint64_t offset;
+    float prob;
+};
+
+struct LengthBucket {
+    std::string pool;
+    std::vector<SmoothedKey> keys;
+};
+
+
+/**
+ * the tables of CountTables, in the order they are kept in counts.bin
  */
-class Digit {
+enum CountKind {
+    COUNT_STRUCTURE = 0,
+    COUNT_DIGIT_LONG,
+    COUNT_DIGIT_SHORT,
+    COUNT_LETTER_LONG,
+    COUNT_LETTER_SHORT,
+    COUNT_SPECIAL_LONG,
+    COUNT_SPECIAL_SHORT,
+    COUNT_KINDS
+};
+
+const char *const COUNT_KIND_NAMES[COUNT_KINDS] = {"structures", "digits (long)", "digits (short)", "letters (long)",
+                                                   "letters (short)", "special (long)", "special (short)"};
+
+/**
+ * the counts collected from one shard of the training set.
+ * every training thread fills its own CountTables, they are merged before the model is written.
+ */
+class CountTables {
 public:
-    Digit(std::string data, float p) {
-        str = std::move(data);
-        prob = p;
-    };
+    CountTable structure_map;
+    CountTable digit_map_long;
+    CountTable digit_map_short;
+    CountTable letter_map_long;
+    CountTable letter_map_short;
+    CountTable special_map_long;
+    CountTable special_map_short;
+    long long training_set_size = 0;
+    long long useful_set_size = 0;
+    // the training set these counts come from, an index into sources
+    size_t source = 0;
+    // lines and bytes counted by this shard, the progress is told in steps of PROGRESS_LINES
+    long long lines = 0;
+    long long bytes = 0;
+    long long reported_lines = 0;
+    long long reported_bytes = 0;
+    // with --approximate, structures, digits and specials are counted here instead
+    LengthSketches structure_sketch;
+    LengthSketches digit_sketch_long;
+    LengthSketches digit_sketch_short;
+    LengthSketches special_sketch_long;
+    LengthSketches special_sketch_short;
 
-    std::string getStr() {
-        return str;
+    /**
+     * add the counts of other to this one, other is left empty
+     */
+    void merge(CountTables &other) {
+        structure_map.merge(other.structure_map);
+        digit_map_long.merge(other.digit_map_long);
+        digit_map_short.merge(other.digit_map_short);
+        letter_map_long.merge(other.letter_map_long);
+        letter_map_short.merge(other.letter_map_short);
+        special_map_long.merge(other.special_map_long);
+        special_map_short.merge(other.special_map_short);
+        structure_sketch.merge(other.structure_sketch);
+        digit_sketch_long.merge(other.digit_sketch_long);
+        digit_sketch_short.merge(other.digit_sketch_short);
+        special_sketch_long.merge(other.special_sketch_long);
+        special_sketch_short.merge(other.special_sketch_short);
+        training_set_size += other.training_set_size;
+        useful_set_size += other.useful_set_size;
+        other.training_set_size = 0;
+        other.useful_set_size = 0;
     }
 
-    float getProb() {
-        return prob;
+    /**
+     * key the digits, letters and specials by where they are in the line instead of copying them,
+     * only if the lines stay where they are until the counts are saved.
+     * structures are made up while counting and are always copied.
+     */
+    void key_views(bool on) {
+        digit_map_long.key_views(on);
+        digit_map_short.key_views(on);
+        letter_map_long.key_views(on);
+        letter_map_short.key_views(on);
+        special_map_long.key_views(on);
+        special_map_short.key_views(on);
     }
 
-protected:
-    std::string str;
-    float prob;
+    CountTable &table(int kind) {
+        CountTable *tables[] = {&structure_map, &digit_map_long, &digit_map_short, &letter_map_long,
+                                &letter_map_short, &special_map_long, &special_map_short};
+        return *tables[kind];
+    }
+
+    const CountTable &table(int kind) const {
+        return const_cast<CountTables *>(this)->table(kind);
+    }
+
+    void approximate(size_t counters) {
+        structure_sketch.set_capacity(counters);
+        digit_sketch_long.set_capacity(counters);
+        digit_sketch_short.set_capacity(counters);
+        special_sketch_long.set_capacity(counters);
+        special_sketch_short.set_capacity(counters);
+    }
+
+    /**
+     * move the estimated counts of the sketches into the tables
+     */
+    void export_sketches() {
+        structure_sketch.export_to(structure_map);
+        digit_sketch_long.export_to(digit_map_long);
+        digit_sketch_short.export_to(digit_map_short);
+        special_sketch_long.export_to(special_map_long);
+        special_sketch_short.export_to(special_map_short);
+    }
+
+    /**
+     * bytes held by the tables, the sketches have a fixed size and are not counted
+     */
+    size_t memory_bytes() const {
+        return structure_map.memory_bytes() + digit_map_long.memory_bytes() + digit_map_short.memory_bytes()
+               + letter_map_long.memory_bytes() + letter_map_short.memory_bytes()
+               + special_map_long.memory_bytes() + special_map_short.memory_bytes();
+    }
 };
 
 /**
- * keep the special part of the passwords, and the frequency of the special.
- * for example, 
- * Special *s = new Special("^_^", 0.4);
+ * where the tables of counts.bin start
  */
-class Special {
-public:
-    Special(std::string data, float p) {
-        str = std::move(data);
-        prob = p;
-    };
+struct CountsHeader {
+    int32_t bands[2];
+    int64_t sizes[2];
+    uint64_t offsets[COUNT_KINDS];
+};
 
-    std::string getStr() {
-        return str;
+
+/**
+ * one --training-set: the counts taken from it, then the merged counts file its part of the model is made of.
+ * the model mixes the sources by weight, every source has its own length bands weight (calc_weight).
+ */
+struct TrainingSource {
+    std::string path;
+    double weight = 1;
+    CorpusReader reader;
+    CountTables counts;
+    // whatever did not fit into memory_budget
+    std::vector<std::string> spilled_runs[COUNT_KINDS];
+    long long training_set_size = 0;
+    long long useful_set_size = 0;
+    std::string counts_file;
+    CountsHeader counts_output{};
+    // for --report: what was read, the distinct keys of every table and the most bytes one of its tables took
+    long long lines = 0;
+    long long bytes = 0;
+    uint64_t table_keys[COUNT_KINDS] = {0};
+    size_t table_bytes[COUNT_KINDS] = {0};
+    // with --evaluate the model is made from the sorted tables of counts, there is no counts_file
+    bool in_memory = false;
+};
+
+/**
+ * the words of dictionary.txt grouped the way guess does: by their size, every word of a size
+ * has the probability 1 / (number of lines of that size), duplicates are listed once.
+ * for example,
+ * DictionaryModel dictionary;
+ * dictionary.add("password", 8, true);
+ * dictionary.build(letters);
+ */
+class DictionaryModel {
+public:
+    /**
+     * one line of dictionary.txt, copied unless it stays where it is until build()
+     */
+    void add(const char *line, int size, bool copy) {
+        auto *cr = (const char *) memchr(line, '\r', (size_t) size);
+        if (cr != nullptr) {
+            size = (int) (cr - line);
+        }
+        int length = model_word_size(line, (size_t) size);
+        if (length <= 0 || length >= MODEL_MAX_LENGTH) {
+            return;
+        }
+        number_of_words[length]++;
+        words.push_back(Word{copy ? arena.intern(line, (size_t) size) : line, (uint32_t) size, length});
     }
 
-    float getProb() {
-        return prob;
+    void build(ModelTerminalsBuilder &letters) {
+        std::sort(words.begin(), words.end(), [](const Word &a, const Word &b) {
+            return a.length < b.length || (a.length == b.length && key_less(a.str, a.size, b.str, b.size));
+        });
+        for (size_t i = 0; i < words.size(); i++) {
+            const Word &w = words[i];
+            if (i > 0 && w.length == words[i - 1].length && w.size == words[i - 1].size
+                && memcmp(w.str, words[i - 1].str, w.size) == 0) {
+                continue;
+            }
+            letters.add(w.length, 1.0 / number_of_words[w.length], w.str, w.size);
+        }
     }
 
-protected:
-    std::string str;
-    float prob;
+private:
+    struct Word {
+        const char *str;
+        uint32_t size;
+        int length;
+    };
+
+    StringArena arena;
+    std::vector<Word> words;
+    long long number_of_words[MODEL_MAX_LENGTH] = {0};
 };
 
 
@@ -115,18 +316,33 @@ std::string tmp_model_output_path;
 std::string external_dict_path;
 int transfer_min_len = 1;
 int transfer_max_len = 255;
-
-int training_set_size;
-int useful_set_size;
-int dictionary_size;
-
-std::map<std::string, int> structure_map;
-std::map<std::string, int> digit_map_long;
-std::map<std::string, int> digit_map_short;
-std::map<std::string, int> letter_map_long;
-std::map<std::string, int> letter_map_short;
-std::map<std::string, int> special_map_long;
-std::map<std::string, int> special_map_short;
+int training_threads = 1;
+ModelFileWriter model_file;
+
+// the training sets, each counted on its own and mixed when the model is written
+std::deque<TrainingSource> sources;
+long long memory_budget = 0;
+long long shard_budget = 0;
+std::string spill_dir;
+std::mutex spill_mutex;
+int spill_number = 0;
+bool spill_failed = false;
+long long approximate_counters = 0;
+// with --weighted every line is "count<TAB>password" or "count password"
+bool weighted_input = false;
+std::atomic<long long> unweighted_lines(0);
+// --progress and --report
+double progress_interval = 10;
+std::string report_path;
+TrainStats stats;
+const long long PROGRESS_LINES = 4096;
+// --evaluate: k folds, every one is guessed by a model of the others, all in memory
+int evaluate_folds = 0;
+long long guess_number = 10000000;
+long guess_min_len = 1;
+long guess_max_len = 255;
+// false while the folds are evaluated, then only the model in memory is made
+bool text_model = true;
 
 
 /**
@@ -135,52 +351,113 @@ std::map<std::string, int> special_map_short;
 void help();
 
 
-void extract_structure(const char *line, int size);
+void train_line(CountTables &tables, const char *line, int size, CountTable *test_set = nullptr);
+
+void report_progress(CountTables &tables);
+
+bool parse_weight(const char *&line, int &size, long long &weight);
+
+template<class Table>
+void count_line(CountTables &tables, const char *line, int size, long long weight, Table &structure_map,
+                Table &digit_map_long, Table &digit_map_short, Table &special_map_long, Table &special_map_short);
+
+void report_sketches(const TrainingSource &source);
 
-void extract_digit(const char *line, int size, unsigned int min_len, std::map<std::string, int> &digit_map);
+void report_tables(const TrainingSource &source);
 
-void extract_letter(const char *line, int size, unsigned int min_len, std::map<std::string, int> &letter_map);
+bool parse_source(const std::string &arg, TrainingSource &source);
 
-void extract_special(const char *line, int size, unsigned int min_len, std::map<std::string, int> &special_map);
+template<typename Chunk>
+void split_blocks(TrainingSource &source, int threads, const Chunk &chunk);
+
+void train(TrainingSource &source, int threads);
+
+int evaluate(TrainingSource &source);
+
+void count_folds(TrainingSource &source, int threads, std::vector<CountTables> &folds, std::vector<CountTable> &tests);
+
+void add_counts(CountTables &to, const CountTables &from);
+
+void write_fold_curves(const std::vector<long long> &checkpoints, const std::vector<std::vector<long long> > &accounts,
+                       const std::vector<std::vector<long long> > &unique, const std::vector<CountTable> &tests);
+
+void spill_tables(CountTables &tables);
+
+bool save_counts(TrainingSource &source, const std::string &previous_file, const CountsHeader &previous);
+
+bool read_counts_header(const std::string &counts_file, CountsHeader &header);
+
+bool open_counts(const TrainingSource &source, CountRunReader &reader, CountKind kind);
+
+bool smooth_counts(CountKind long_kind, CountKind short_kind, std::vector<LengthBucket> &buckets);
+
+template<typename Task>
+void parallel_for(const std::vector<size_t> &items, int threads, const Task &task);
+
+std::vector<size_t> largest_buckets_first(const std::vector<LengthBucket> &buckets);
+
+void sort_buckets(std::vector<LengthBucket> &buckets, int threads);
+
+bool process_terminals(CountKind long_kind, CountKind short_kind, const char *folder, ModelTerminalKind model_kind);
+
+template<class Table>
+void extract_structure(const Segmenter &segmenter, long long weight, Table &structure_map);
+
+template<class Table>
+void extract_segments(const Segmenter &segmenter, const char *line, int min_len, long long weight,
+                      Table &digit_map, CountTable &letter_map, Table &special_map);
 
 bool negative_sort_structure(Structure *e1, Structure *e2);
 
-void process_structure();
+bool process_structure();
 
-void process_digit();
+bool process_digit();
 
-void process_special();
+bool process_special();
 
-void process_letter();
+bool process_letter();
 
-void create_dir(const char *dir);
+bool build_model();
 
-float calc_weight(int size);
+void create_dir(const char *dir);
 
-int get_training_set_size(const char *training_set);
+float calc_weight(long long size);
 
 int rm_dir(const std::string &dir_full_path);
 
 int main(int argc, char *argv[]) {
-    std::string training_set;
+    std::vector<std::string> training_sets;
     std::vector<std::string> vec;
     bool rm_existed = false;
+    bool update_model = false;
+    long long memory_budget_mb = 0;
     // parse arguments
     if (argc == 1) {
         help();
     }
-    auto cmd = (clipp::required("--training-set") & clipp::value("path of training set", training_set),
-            clipp::required("--trained-model") & clipp::value("path to save the trained model", model_output_path),
+    auto cmd = (clipp::required("--training-set") & clipp::values("path of training set[:weight]", training_sets),
+            clipp::option("--trained-model") & clipp::value("path to save the trained model", model_output_path),
             clipp::option("--train-length-min") & clipp::value("min length to transfer", transfer_min_len),
             clipp::option("--train-length-max") & clipp::value("max length to transfer", transfer_max_len),
             clipp::required("--dictionaries") &
             clipp::value("external dictionary, one item per line", external_dict_path),
+            clipp::option("--threads") & clipp::value("number of training threads", training_threads),
+            clipp::option("--update").set(update_model).doc("add the training set to the counts of the model"),
+            clipp::option("--memory-budget") & clipp::value("MB of counts kept in memory", memory_budget_mb),
+            clipp::option("--approximate") & clipp::value("counters per length", approximate_counters),
+            clipp::option("--weighted").set(weighted_input).doc("every line of the training set is count<TAB>password"),
+            clipp::option("--progress") & clipp::value("seconds between progress lines", progress_interval),
+            clipp::option("--report") & clipp::value("JSON file for the statistics of the run", report_path),
+            clipp::option("--evaluate") & clipp::value("number of folds to evaluate", evaluate_folds),
+            clipp::option("--guess-number") & clipp::value("guesses per fold", guess_number),
+            clipp::option("--guess-min-len") & clipp::value("min length of a guess", guess_min_len),
+            clipp::option("--guess-max-len") & clipp::value("max length of a guess", guess_max_len),
             clipp::option("--rm-existed").set(rm_existed).doc("remove model with same path")
     );
-    if (!clipp::parse(argc, argv, cmd)) {
+    if (!clipp::parse(argc, argv, cmd) || (evaluate_folds == 0 && model_output_path.empty())) {
         std::cerr << clipp::make_man_page(cmd, argv[0]) << std::endl;
         std::exit(1);
-    } else {
+    } else if (evaluate_folds == 0) {
         if (model_output_path[model_output_path.size() - 1] != PATH_DELIMITER)
             model_output_path += PATH_DELIMITER;
         create_dir(model_output_path.c_str());
@@ -193,178 +470,833 @@ int main(int argc, char *argv[]) {
             rm_dir(digit_folder);
             rm_dir(special_folder);
             rm_dir(struct_folder);
+            // guess reads model.bin before the text model, an update still needs the counts it adds to
+            std::remove((model_output_path + "model.bin").c_str());
+            if (!update_model) {
+                std::remove((model_output_path + "counts.bin").c_str());
+            }
         }
     }
 
 
-    std::string line;
+    // counts of the existing model, an update goes on with its length bands
+    CountsHeader previous{};
+    std::string counts_file = model_output_path + "counts.bin";
+    if (update_model && training_sets.size() > 1) {
+        std::cerr << "Error: only a model trained from one training set can be updated!" << std::endl;
+        return -1;
+    }
+    if (update_model) {
+        if (!read_counts_header(counts_file, previous)) {
+            std::cerr << "[Update]: Could not read the counts of the model " << counts_file << std::endl;
+            return -1;
+        }
+        int min_len = previous.bands[0], max_len = previous.bands[1];
+        if ((transfer_min_len != 1 && transfer_min_len != min_len)
+            || (transfer_max_len != 255 && transfer_max_len != max_len)) {
+            std::cerr << "Error: the model was trained with lengths " << min_len << " to " << max_len << "!"
+                      << std::endl;
+            return -1;
+        }
+        transfer_min_len = min_len;
+        transfer_max_len = max_len;
+    }
 
     if (transfer_min_len > transfer_max_len) {
         std::cerr << "Error: min length larger than max length!" << std::endl;
         return -1;
     }
-
-    training_set_size = get_training_set_size(training_set.c_str());
-    if (training_set_size == -2) {
+    if (training_threads < 1) {
+        std::cerr << "Error: number of threads should be at least 1!" << std::endl;
+        return -1;
+    }
+    if (approximate_counters < 0) {
+        std::cerr << "Error: number of counters should not be negative!" << std::endl;
         return -1;
     }
-    std::ifstream input_training;
-    input_training.open(training_set.c_str());
-    if (!input_training.is_open()) {
-        std::cerr << "Could not open file " << training_set << std::endl;
+    if (memory_budget_mb < 0) {
+        std::cerr << "Error: memory budget should not be negative!" << std::endl;
         return -1;
     }
+    if (progress_interval < 0) {
+        std::cerr << "Error: progress interval should not be negative!" << std::endl;
+        return -1;
+    }
+    if (evaluate_folds != 0) {
+        if (evaluate_folds < 2) {
+            std::cerr << "Error: at least 2 folds are needed to evaluate!" << std::endl;
+            return -1;
+        }
+        if (update_model || approximate_counters > 0 || memory_budget_mb > 0 || training_sets.size() > 1) {
+            std::cerr << "Error: --evaluate takes one training set and counts it exactly in memory!" << std::endl;
+            return -1;
+        }
+        if (guess_number < 1 || guess_min_len > guess_max_len) {
+            std::cerr << "Error: the number of guesses should be positive and min length not larger than max length!"
+                      << std::endl;
+            return -1;
+        }
+        text_model = false;
+    }
+    for (const std::string &arg : training_sets) {
+        sources.emplace_back();
+        if (!parse_source(arg, sources.back())) {
+            std::cerr << "Error: the weight of training set " << arg << " should be a positive number!" << std::endl;
+            return -1;
+        }
+    }
+    // every training set gets its share of the threads, and at least one
+    int threads_per_source = std::max(1, training_threads / (int) sources.size());
+    if (memory_budget_mb > 0) {
+        memory_budget = memory_budget_mb << 20;
+        shard_budget = memory_budget / (threads_per_source * (long long) sources.size());
+        spill_dir = model_output_path + "spill" + PATH_DELIMITER;
+        create_dir(spill_dir.c_str());
+    }
+
+    if (-1 == access(external_dict_path.c_str(), R_OK)) {
+        std::cerr << "[Dict]: Could not open file " << external_dict_path << std::endl;
+        std::cout << "will not use dictionary" << std::endl;
+    }
+    for (TrainingSource &source : sources) {
+        if (!source.reader.open(source.path.c_str())) {
+            std::cerr << "[Training set]: Could not open file " << source.path << std::endl;
+            if (source.reader.compression() != COMPRESSION_NONE) {
+                std::cerr << "this build cannot read " << compression_name(source.reader.compression()) << std::endl;
+            }
+            return -1;
+        }
+    }
 
     /**
-     * training
+     * training, a single pass over every corpus, the corpora are counted at the same time.
+     * training_set_size and useful_set_size are counted on the way.
+     * a mapped corpus stays open until the counts are saved, the tables only point into it.
      */
-    while (!input_training.eof()) {
-        getline(input_training, line);
-        int size = line.size();
-        if (size <= 0) {
-            continue;
+    stats.start_progress(progress_interval);
+    if (evaluate_folds > 0) {
+        int result = evaluate(sources[0]);
+        stats.stop_progress();
+        if (result == 0 && !report_path.empty() && !stats.write_report(report_path, training_threads)) {
+            std::cerr << "[Error] could not write " << report_path << std::endl;
+            return -1;
+        }
+        return result;
+    }
+    {
+        TrainStats::Phase phase(stats, "counting");
+        std::vector<std::thread> trainers;
+        for (size_t i = 0; i < sources.size(); i++) {
+            sources[i].counts.source = i;
+            trainers.emplace_back([i, threads_per_source]() { train(sources[i], threads_per_source); });
+        }
+        for (auto &trainer : trainers) {
+            trainer.join();
+        }
+        if (approximate_counters > 0) {
+            for (TrainingSource &source : sources) {
+                report_sketches(source);
+                source.counts.export_sketches();
+            }
         }
-        if (transfer_min_len <= size && size <= transfer_max_len) {
-            useful_set_size += 1;
-            extract_structure(line.c_str(), size);
-
-            extract_digit(line.c_str(), size, 1, digit_map_long);
-            extract_letter(line.c_str(), size, 1, letter_map_long);
-            extract_special(line.c_str(), size, 1, special_map_long);
-        } else if (size >= 8 && size < transfer_min_len) {
-            extract_digit(line.c_str(), size, size, digit_map_short);
-            extract_letter(line.c_str(), size, size, letter_map_short);
-            extract_special(line.c_str(), size, size, special_map_short);
-        } else if (0 < size && size < 8) {
-            extract_digit(line.c_str(), size, 1, digit_map_short);
-            extract_letter(line.c_str(), size, 1, letter_map_short);
-            extract_special(line.c_str(), size, 1, special_map_short);
-        }
-    }
-    process_structure();
-    process_digit();
-    process_special();
-    process_letter();
+    }
+    for (TrainingSource &source : sources) {
+        if (source.reader.failed()) {
+            std::cerr << "[Training set]: " << source.path << " is corrupt or cut off" << std::endl;
+            return -1;
+        }
+    }
+    if (unweighted_lines > 0) {
+        std::cerr << "[Weighted]: skipped " << unweighted_lines << " lines without a count" << std::endl;
+    }
+    if (spill_failed) {
+        std::cerr << "[Error] could not spill the counts to " << spill_dir << std::endl;
+        return -1;
+    }
+    // the counts are merged into counts.bin first, the model is made from its sorted tables.
+    // a model of several training sets keeps no counts, it cannot be updated.
+    for (size_t i = 0; i < sources.size(); i++) {
+        TrainStats::Phase phase(stats, "saving counts");
+        TrainingSource &source = sources[i];
+        source.training_set_size += previous.sizes[0];
+        source.useful_set_size += previous.sizes[1];
+        source.counts_file = counts_file + (sources.size() > 1 ? "." + std::to_string(i) : "") + ".tmp";
+        if (!save_counts(source, update_model ? counts_file : "", previous)) {
+            std::cerr << "[Error] could not write " << source.counts_file << std::endl;
+            std::remove(source.counts_file.c_str());
+            return -1;
+        }
+        // the counts may point into the mapped training set until they are saved
+        source.reader.close();
+        report_tables(source);
+    }
+    if (memory_budget > 0) {
+        rmdir(spill_dir.c_str());
+    }
+    // model.bin is filled section by section while the text model is written.
+    // the old one goes first, guess would read it instead of the new text model if this one is not written
+    std::string binary_model = model_output_path + "model.bin";
+    std::remove(binary_model.c_str());
+    if (!model_file.open(binary_model)) {
+        std::cerr << "[Error] could not write " << binary_model << std::endl;
+        for (const TrainingSource &source : sources) {
+            std::remove(source.counts_file.c_str());
+        }
+        return -1;
+    }
+    if (!build_model()) {
+        for (const TrainingSource &source : sources) {
+            std::remove(source.counts_file.c_str());
+        }
+        return -1;
+    }
+    {
+        TrainStats::Phase phase(stats, "syncing");
+        if (!model_file.close()) {
+            std::cerr << "[Error] could not write " << binary_model << std::endl;
+            for (const TrainingSource &source : sources) {
+                std::remove(source.counts_file.c_str());
+            }
+            return -1;
+        }
+        // the files started going to disk as they were closed, this waits for all of them and their directories
+        if (!sync_model_dir(model_output_path)) {
+            std::cerr << "[Error] could not sync " << model_output_path << std::endl;
+        }
+    }
+    if (sources.size() > 1) {
+        for (const TrainingSource &source : sources) {
+            std::remove(source.counts_file.c_str());
+        }
+        std::remove(counts_file.c_str());
+    } else if (std::rename(sources[0].counts_file.c_str(), counts_file.c_str()) != 0) {
+        std::cerr << "[Error] could not write " << counts_file << std::endl;
+        return -1;
+    }
+    stats.stop_progress();
+    if (!report_path.empty() && !stats.write_report(report_path, training_threads)) {
+        std::cerr << "[Error] could not write " << report_path << std::endl;
+        return -1;
+    }
     return 0;
 
 }
 
+/**
+ * count one line of the training set, exactly or into the sketches.
+ * with a test_set, the password is added to it as well, as many times as it has accounts.
+ */
+void train_line(CountTables &tables, const char *line, int size, CountTable *test_set) {
+    tables.lines++;
+    tables.bytes += size + 1;
+    if (tables.lines % PROGRESS_LINES == 0) {
+        report_progress(tables);
+        if (memory_budget > 0 && tables.memory_bytes() > (size_t) shard_budget) {
+            spill_tables(tables);
+        }
+    }
+    long long weight = 1;
+    if (size <= 0 || (weighted_input && !parse_weight(line, size, weight))) {
+        return;
+    }
+    if (test_set != nullptr) {
+        test_set->add(line, (size_t) size, weight);
+    }
+    if (approximate_counters > 0) {
+        count_line(tables, line, size, weight, tables.structure_sketch, tables.digit_sketch_long,
+                   tables.digit_sketch_short, tables.special_sketch_long, tables.special_sketch_short);
+    } else {
+        count_line(tables, line, size, weight, tables.structure_map, tables.digit_map_long, tables.digit_map_short,
+                   tables.special_map_long, tables.special_map_short);
+    }
+}
+
+/**
+ * add what a shard counted since the last call to the progress
+ */
+void report_progress(CountTables &tables) {
+    stats.add_progress(tables.lines - tables.reported_lines, tables.bytes - tables.reported_bytes);
+    tables.reported_lines = tables.lines;
+    tables.reported_bytes = tables.bytes;
+}
+
+/**
+ * split a weighted line into its count and its password, as written by `sort | uniq -c`
+ * ("   42 123456") or with a tab ("42\t123456"). the password is everything after the one
+ * separator, spaces included. lines without a count are skipped, lines with count 0 too.
+ */
+bool parse_weight(const char *&line, int &size, long long &weight) {
+    int i = 0;
+    while (i < size && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    int digits = i;
+    weight = 0;
+    while (i < size && '0' <= line[i] && line[i] <= '9' && weight < (1LL << 58)) {
+        weight = weight * 10 + (line[i] - '0');
+        i++;
+    }
+    if (i == digits || i == size || (line[i] != ' ' && line[i] != '\t')) {
+        unweighted_lines++;
+        return false;
+    }
+    line += i + 1;
+    size -= i + 1;
+    return weight > 0 && size > 0;
+}
+
+/**
+ * count one line of the training set into the band it belongs to, weight times
+ */
+template<class Table>
+void count_line(CountTables &tables, const char *line, int size, long long weight, Table &structure_map,
+                Table &digit_map_long, Table &digit_map_short, Table &special_map_long, Table &special_map_short) {
+    static thread_local Segmenter segmenter;
+    TrainStats::StepClock clock(stats);
+    tables.training_set_size += weight;
+    if (transfer_min_len <= size && size <= transfer_max_len) {
+        tables.useful_set_size += weight;
+        segmenter.split(line, size);
+        clock.lap(STEP_SPLIT);
+        extract_structure(segmenter, weight, structure_map);
+        clock.lap(STEP_STRUCTURE);
+        extract_segments(segmenter, line, 1, weight, digit_map_long, tables.letter_map_long, special_map_long);
+        clock.lap(STEP_SEGMENTS);
+    } else if (size >= 8 && size < transfer_min_len) {
+        segmenter.split(line, size);
+        clock.lap(STEP_SPLIT);
+        extract_segments(segmenter, line, size, weight, digit_map_short, tables.letter_map_short, special_map_short);
+        clock.lap(STEP_SEGMENTS);
+    } else if (0 < size && size < 8) {
+        segmenter.split(line, size);
+        clock.lap(STEP_SPLIT);
+        extract_segments(segmenter, line, 1, weight, digit_map_short, tables.letter_map_short, special_map_short);
+        clock.lap(STEP_SEGMENTS);
+    }
+}
+
+/**
+ * hand every block of the training set to chunk(thread, begin, end, offset), offset being where begin is in the
+ * training set. with more than one thread, every block is cut into one chunk per thread at line boundaries and
+ * the chunks are counted at the same time.
+ */
+template<typename Chunk>
+void split_blocks(TrainingSource &source, int threads, const Chunk &chunk) {
+    CorpusReader &input_training = source.reader;
+    const char *begin, *end;
+    uint64_t offset = 0;
+    // how long every block is waited for, i.e. reading and decompressing that the counting did not hide
+    auto waited = std::chrono::steady_clock::now();
+    while (input_training.next_block(begin, end)) {
+        stats.add_read_time(std::chrono::steady_clock::now() - waited);
+        if (threads == 1) {
+            chunk(0, begin, end, offset);
+        } else {
+            std::vector<std::thread> workers;
+            const char *chunk_begin = begin;
+            for (int t = 0; t < threads && chunk_begin < end; t++) {
+                const char *chunk_end = end;
+                if (t < threads - 1) {
+                    chunk_end = begin + (end - begin) / threads * (t + 1);
+                    if (chunk_end < chunk_begin) {
+                        chunk_end = chunk_begin;
+                    }
+                    auto *nl = (const char *) memchr(chunk_end, '\n', end - chunk_end);
+                    chunk_end = nl == nullptr ? end : nl + 1;
+                }
+                uint64_t chunk_offset = offset + (chunk_begin - begin);
+                workers.emplace_back([&chunk, t, chunk_begin, chunk_end, chunk_offset]() {
+                    chunk(t, chunk_begin, chunk_end, chunk_offset);
+                });
+                chunk_begin = chunk_end;
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+        }
+        offset += (uint64_t) (end - begin);
+        waited = std::chrono::steady_clock::now();
+    }
+}
+
+/**
+ * count the whole training set into the global counts.
+ * every thread counts its chunks into its own CountTables, and the tables are merged pairwise
+ * in parallel at the end. with a memory budget the shards are spilled instead of merged.
+ */
+void train(TrainingSource &source, int threads) {
+    std::vector<CountTables> shards(threads);
+    for (CountTables &shard : shards) {
+        shard.source = source.counts.source;
+        shard.approximate((size_t) approximate_counters);
+        shard.key_views(source.reader.is_mapped());
+    }
+    split_blocks(source, threads, [&shards](int t, const char *begin, const char *end, uint64_t) {
+        CountTables &shard = shards[t];
+        CorpusReader::split_lines(begin, end, [&shard](const char *line, int size) {
+            train_line(shard, line, size);
+        });
+    });
+    for (CountTables &shard : shards) {
+        report_progress(shard);
+        source.lines += shard.lines;
+        source.bytes += shard.bytes;
+    }
+    if (memory_budget > 0) {
+        std::vector<std::thread> spillers;
+        for (int t = 0; t < threads; t++) {
+            CountTables *shard = &shards[t];
+            spillers.emplace_back([shard]() { spill_tables(*shard); });
+        }
+        for (auto &spiller : spillers) {
+            spiller.join();
+        }
+    }
+    // reduction: in every round, shard i takes over shard i + step
+    for (int step = 1; step < threads; step *= 2) {
+        std::vector<std::thread> mergers;
+        for (int i = 0; i + step < threads; i += 2 * step) {
+            CountTables *dst = &shards[i];
+            CountTables *src = &shards[i + step];
+            mergers.emplace_back([dst, src]() { dst->merge(*src); });
+        }
+        for (auto &merger : mergers) {
+            merger.join();
+        }
+    }
+    source.counts.merge(shards[0]);
+    source.training_set_size = source.counts.training_set_size;
+    source.useful_set_size = source.counts.useful_set_size;
+}
+
+/**
+ * k-fold evaluation without going to disk: every line of the training set goes to one of k folds. the model of
+ * fold f is trained from the counts of the other folds, made in memory like model.bin, and its guesses are looked
+ * up in the passwords of fold f. the share of the fold's accounts (and distinct passwords) cracked after
+ * 10, 100, ... guesses is printed as one row per number of guesses: the mean of the folds, then every fold.
+ */
+int evaluate(TrainingSource &source) {
+    auto k = (size_t) evaluate_folds;
+    std::vector<CountTables> folds(k);
+    std::vector<CountTable> tests(k);
+    {
+        TrainStats::Phase phase(stats, "counting folds");
+        count_folds(source, training_threads, folds, tests);
+    }
+    if (source.reader.failed()) {
+        std::cerr << "[Training set]: " << source.path << " is corrupt or cut off" << std::endl;
+        return -1;
+    }
+    if (unweighted_lines > 0) {
+        std::cerr << "[Weighted]: skipped " << unweighted_lines << " lines without a count" << std::endl;
+    }
+    // the models are made one after the other, making one uses all threads already
+    std::vector<std::string> models(k);
+    source.in_memory = true;
+    for (size_t f = 0; f < k; f++) {
+        CountTables &counts = source.counts;
+        for (int kind = 0; kind < COUNT_KINDS; kind++) {
+            // the folds keep their keys until the end
+            counts.table(kind).key_views(true);
+        }
+        for (size_t g = 0; g < k; g++) {
+            if (g != f) {
+                add_counts(counts, folds[g]);
+            }
+        }
+        source.training_set_size = counts.training_set_size;
+        source.useful_set_size = counts.useful_set_size;
+        for (int kind = 0; kind < COUNT_KINDS; kind++) {
+            counts.table(kind).sort();
+        }
+        model_file.open_memory();
+        if (!build_model()) {
+            return -1;
+        }
+        model_file.close();
+        models[f] = model_file.image();
+        for (int kind = 0; kind < COUNT_KINDS; kind++) {
+            counts.table(kind).clear();
+        }
+        counts.training_set_size = 0;
+        counts.useful_set_size = 0;
+    }
+    std::vector<long long> checkpoints;
+    for (long long n = 10; n < guess_number; n *= 10) {
+        checkpoints.push_back(n);
+    }
+    checkpoints.push_back(guess_number);
+    std::vector<std::vector<long long> > accounts(k, std::vector<long long>(checkpoints.size(), 0));
+    std::vector<std::vector<long long> > unique(k, std::vector<long long>(checkpoints.size(), 0));
+    std::atomic<bool> broken(false);
+    {
+        TrainStats::Phase phase(stats, "enumerating");
+        std::vector<size_t> order;
+        for (size_t f = 0; f < k; f++) {
+            order.push_back(f);
+        }
+        // every fold is guessed by its own thread, its test set is only read
+        parallel_for(order, training_threads, [&](size_t f) {
+            ModelFile model;
+            if (!model.open_memory(models[f].data(), models[f].size())) {
+                broken = true;
+                return;
+            }
+            GuessQueue queue;
+            if (!queue.load(model)) {
+                broken = true;
+                return;
+            }
+            KeySet cracked;
+            long long guesses = 0, cracked_accounts = 0, cracked_unique = 0;
+            size_t next = 0;
+            bool enumerated = queue.for_each_guess(guess_min_len, guess_max_len, [&](const char *guess, size_t size) {
+                const long long *count = tests[f].find(guess, size);
+                if (count != nullptr && cracked.insert(guess, size)) {
+                    cracked_accounts += *count;
+                    cracked_unique++;
+                }
+                if (++guesses == checkpoints[next]) {
+                    accounts[f][next] = cracked_accounts;
+                    unique[f][next] = cracked_unique;
+                    next++;
+                }
+                return next < checkpoints.size();
+            });
+            if (!enumerated) {
+                broken = true;
+                return;
+            }
+            // a model that runs out of guesses cracks no more
+            for (; next < checkpoints.size(); next++) {
+                accounts[f][next] = cracked_accounts;
+                unique[f][next] = cracked_unique;
+            }
+        });
+    }
+    if (broken) {
+        std::cerr << "[Error] could not read the model of a fold" << std::endl;
+        return -1;
+    }
+    write_fold_curves(checkpoints, accounts, unique, tests);
+    return 0;
+}
+
+/**
+ * count the training set into k folds at once, a line goes to the fold picked by a hash of where it starts.
+ * so the folds are the same whatever the number of threads, and repeated passwords are spread over the folds.
+ * folds[f] gets the counts of the lines of fold f, tests[f] their passwords.
+ */
+void count_folds(TrainingSource &source, int threads, std::vector<CountTables> &folds, std::vector<CountTable> &tests) {
+    auto k = (size_t) evaluate_folds;
+    // the tables of thread t and fold f are shards[t * k + f]
+    std::vector<CountTables> shards(threads * k);
+    std::vector<CountTable> shard_tests(threads * k);
+    for (size_t n = 0; n < shards.size(); n++) {
+        shards[n].key_views(source.reader.is_mapped());
+        shard_tests[n].key_views(source.reader.is_mapped());
+    }
+    split_blocks(source, threads, [&shards, &shard_tests, k](int t, const char *begin, const char *end,
+                                                             uint64_t offset) {
+        CountTables *fold_shards = &shards[t * k];
+        CountTable *fold_tests = &shard_tests[t * k];
+        CorpusReader::split_lines(begin, end, [=](const char *line, int size) {
+            // splitmix64 of the offset of the line
+            uint64_t z = offset + (uint64_t) (line - begin) + 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30u)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27u)) * 0x94d049bb133111ebULL;
+            size_t f = (size_t) ((z ^ (z >> 31u)) % k);
+            train_line(fold_shards[f], line, size, &fold_tests[f]);
+        });
+    });
+    for (CountTables &shard : shards) {
+        report_progress(shard);
+        source.lines += shard.lines;
+        source.bytes += shard.bytes;
+    }
+    std::vector<size_t> order;
+    for (size_t f = 0; f < k; f++) {
+        order.push_back(f);
+    }
+    parallel_for(order, threads, [&](size_t f) {
+        for (int t = 0; t < threads; t++) {
+            folds[f].merge(shards[t * k + f]);
+            tests[f].merge(shard_tests[t * k + f]);
+        }
+    });
+}
+
+/**
+ * add the counts of from to to, from is left as it is
+ */
+void add_counts(CountTables &to, const CountTables &from) {
+    for (int kind = 0; kind < COUNT_KINDS; kind++) {
+        CountTable &table = to.table(kind);
+        for (const CountEntry &entry : from.table(kind).entries()) {
+            table.add(entry.key, entry.size, entry.count);
+        }
+    }
+    to.training_set_size += from.training_set_size;
+    to.useful_set_size += from.useful_set_size;
+}
+
+/**
+ * the crack rates of the folds as tab separated rows on stdout, in percent of the accounts and of the
+ * distinct passwords of a fold. the sizes of the test sets go to stderr.
+ */
+void write_fold_curves(const std::vector<long long> &checkpoints, const std::vector<std::vector<long long> > &accounts,
+                       const std::vector<std::vector<long long> > &unique, const std::vector<CountTable> &tests) {
+    size_t k = tests.size();
+    std::vector<long long> test_accounts(k, 0);
+    for (size_t f = 0; f < k; f++) {
+        for (const CountEntry &entry : tests[f].entries()) {
+            test_accounts[f] += entry.count;
+        }
+        std::cerr << "[Evaluate]: fold " << f + 1 << ": " << test_accounts[f] << " accounts, " << tests[f].size()
+                  << " distinct passwords" << std::endl;
+    }
+    std::cout << "guesses\tcracked\tcracked (distinct)";
+    for (size_t f = 0; f < k; f++) {
+        std::cout << "\tfold " << f + 1;
+    }
+    std::cout << NEW_LINE << std::fixed << std::setprecision(4);
+    for (size_t c = 0; c < checkpoints.size(); c++) {
+        double mean = 0, mean_unique = 0;
+        std::vector<double> rates(k, 0);
+        for (size_t f = 0; f < k; f++) {
+            if (test_accounts[f] > 0) {
+                rates[f] = 100.0 * accounts[f][c] / test_accounts[f];
+                mean_unique += 100.0 * unique[f][c] / tests[f].size() / k;
+            }
+            mean += rates[f] / k;
+        }
+        std::cout << checkpoints[c] << '\t' << mean << '\t' << mean_unique;
+        for (double rate : rates) {
+            std::cout << '\t' << rate;
+        }
+        std::cout << NEW_LINE;
+    }
+    std::cout << std::flush;
+}
+
+/**
+ * "path" or "path:weight", the weight is 1 if left out
+ */
+bool parse_source(const std::string &arg, TrainingSource &source) {
+    source.path = arg;
+    source.weight = 1;
+    size_t colon = arg.rfind(':');
+    if (colon == std::string::npos || colon + 1 == arg.size()) {
+        return true;
+    }
+    char *end;
+    double weight = strtod(arg.c_str() + colon + 1, &end);
+    if (*end != '\0') {
+        // not a weight, e.g. C:\passwords.txt
+        return true;
+    }
+    source.path = arg.substr(0, colon);
+    source.weight = weight;
+    return weight > 0;
+}
+
+/**
+ * counts.bin keeps the raw counts behind the model, so that --update can add a new training set
+ * without going over the old ones again.
+ * native byte order: the magic, a uint32_t version and a CountsHeader, then the tables as
+ * written by write_count_table, sorted by key.
+ */
+const char COUNTS_FILE_MAGIC[8] = {'T', 'P', 'C', 'F', 'G', 'C', 'N', 'T'};
+const uint32_t COUNTS_FILE_VERSION = 2;
+
+/**
+ * merge the counts of a source in memory, its spilled runs and the tables of previous_file (if any)
+ * into its counts_file. the tables and runs are dropped once they are written.
+ */
+bool save_counts(TrainingSource &source, const std::string &previous_file, const CountsHeader &previous) {
+    std::FILE *fout = std::fopen(source.counts_file.c_str(), "wb");
+    if (fout == nullptr) {
+        return false;
+    }
+    std::vector<char> buffer(1u << 22u);
+    setvbuf(fout, buffer.data(), _IOFBF, buffer.size());
+    CountsHeader &counts_output = source.counts_output;
+    counts_output = CountsHeader{};
+    counts_output.bands[0] = transfer_min_len;
+    counts_output.bands[1] = transfer_max_len;
+    counts_output.sizes[0] = source.training_set_size;
+    counts_output.sizes[1] = source.useful_set_size;
+    bool ok = std::fwrite(COUNTS_FILE_MAGIC, sizeof(COUNTS_FILE_MAGIC), 1, fout) == 1
+              && std::fwrite(&COUNTS_FILE_VERSION, sizeof(COUNTS_FILE_VERSION), 1, fout) == 1
+              && std::fwrite(&counts_output, sizeof(counts_output), 1, fout) == 1;
+    for (int kind = 0; kind < COUNT_KINDS && ok; kind++) {
+        CountTable &table = source.counts.table(kind);
+        source.table_bytes[kind] = std::max(source.table_bytes[kind], table.memory_bytes());
+        table.sort();
+        CountMerger merger;
+        merger.add_table(table);
+        for (const std::string &run : source.spilled_runs[kind]) {
+            ok = ok && merger.add_run(run);
+        }
+        if (!previous_file.empty()) {
+            ok = ok && merger.add_run(previous_file, previous.offsets[kind]);
+        }
+        int64_t offset = tell_file(fout);
+        counts_output.offsets[kind] = (uint64_t) offset;
+        ok = ok && offset >= 0 && write_count_run(fout, merger, &source.table_keys[kind]);
+        table.clear();
+        for (const std::string &run : source.spilled_runs[kind]) {
+            std::remove(run.c_str());
+        }
+        source.spilled_runs[kind].clear();
+    }
+    ok = ok && seek_file(fout, sizeof(COUNTS_FILE_MAGIC) + sizeof(COUNTS_FILE_VERSION))
+         && std::fwrite(&counts_output, sizeof(counts_output), 1, fout) == 1;
+    ok = std::fclose(fout) == 0 && ok;
+    return ok;
+}
+
+bool read_counts_header(const std::string &counts_file, CountsHeader &header) {
+    std::FILE *fin = std::fopen(counts_file.c_str(), "rb");
+    if (fin == nullptr) {
+        return false;
+    }
+    char magic[sizeof(COUNTS_FILE_MAGIC)];
+    uint32_t version;
+    bool ok = std::fread(magic, sizeof(magic), 1, fin) == 1
+              && memcmp(magic, COUNTS_FILE_MAGIC, sizeof(magic)) == 0
+              && std::fread(&version, sizeof(version), 1, fin) == 1 && version == COUNTS_FILE_VERSION
+              && std::fread(&header, sizeof(header), 1, fin) == 1;
+    std::fclose(fin);
+    return ok;
+}
+
+/**
+ * read one table of the merged counts of a source, in key order
+ */
+bool open_counts(const TrainingSource &source, CountRunReader &reader, CountKind kind) {
+    if (source.in_memory) {
+        return reader.open(source.counts.table(kind));
+    }
+    if (!reader.open(source.counts_file, source.counts_output.offsets[kind])) {
+        std::cerr << "[Error] could not read " << source.counts_file << std::endl;
+        return false;
+    }
+    return true;
+}
+
 /**
  * how to use
  */
 void help() {
     std::cout << "Usage Info:\n";
-    std::cout << "--training-set\t\ttraining set\n"
+    std::cout << "--training-set\t\ttraining set, several ones are mixed by their weight: a.txt:3 b.txt:1\n"
                  "--trained-model\t\ttrained model will be placed here\n"
                  "--train-length-min\tpwd with length less than this value will be ignored\n"
                  "--train-length-max\tpwd wilt length longer than this value will be ignored\n"
-                 "--dictionaries\t\tto enrich the grammar of letter";
+                 "--dictionaries\t\tto enrich the grammar of letter\n"
+                 "--threads\t\tnumber of threads used to count the training set\n"
+                 "--update\t\tadd the training set to the model instead of training a new one\n"
+                 "--memory-budget\tMB of counts kept in memory, the rest is spilled to the model folder\n"
+                 "--approximate\t\tcount only about this many of the most frequent digits, specials and\n"
+                 "\t\t\tstructures per length\n"
+                 "--weighted\t\tthe training set has been counted already, one \"count<TAB>password\" or\n"
+                 "\t\t\t\"count password\" (uniq -c) per line\n"
+                 "--progress\t\tprint the progress to stderr every this many seconds, 0 for never (10)\n"
+                 "--report\t\twrite the time, memory and keys of every phase and table to this JSON file\n"
+                 "--evaluate\t\tinstead of training a model, split the training set into this many folds,\n"
+                 "\t\t\tguess every fold with a model of the others and print the share cracked\n"
+                 "--guess-number\t\tguesses per fold with --evaluate (10000000)\n"
+                 "--guess-min-len\t\tshortest guess with --evaluate (1)\n"
+                 "--guess-max-len\t\tlongest guess with --evaluate (255)";
     std::cout << std::endl;
     std::exit(0);
 }
 
-// extract structure info
-void extract_structure(const char *line, int size) {
-    std::string result;
-    for (int i = 0; i < size; i++) {
-        if ('0' <= line[i] && '9' >= line[i]) {
-            result += "D";
-        } else if (('a' <= line[i] && 'z' >= line[i]) || ('A' <= line[i] && 'Z' >= line[i])) {
-            result += "L";
-        } else if (0 <= (int) line[i] && 127 >= (int) line[i]) {
-            result += "S";
-        } else {
-            break;
-        }
-    }
-    if (structure_map.find(result) != structure_map.end()) {
-        structure_map[result] += 1;
-    } else {
-        structure_map.insert(make_pair(result, 1));
+/**
+ * how far the approximate counts may be off
+ */
+void report_sketches(const TrainingSource &source) {
+    const CountTables &tables = source.counts;
+    const LengthSketches *sketches[] = {&tables.structure_sketch, &tables.digit_sketch_long, &tables.digit_sketch_short,
+                                        &tables.special_sketch_long, &tables.special_sketch_short};
+    const char *names[] = {"structures", "digits (long)", "digits (short)", "special (long)", "special (short)"};
+    for (int i = 0; i < 5; i++) {
+        std::cout << "[Approximate]: " << (sources.size() > 1 ? source.path + ": " : "") << names[i] << ": "
+                  << sketches[i]->size() << " keys kept, "
+                  << sketches[i]->memory_bytes() / 1024 << " KB, counts at most " << sketches[i]->max_error()
+                  << " too high (" << 100.0 * sketches[i]->max_relative_error() << "% of their length)" << std::endl;
     }
-
 }
 
-// extract digit part
-void extract_digit(const char *line, int size, unsigned int min_len, std::map<std::string, int> &digit_map) {
-    std::vector<std::string> d;
-    std::string val;
-    for (int i = 0; i < size; i++) {
-        if (line[i] >= '0' && line[i] <= '9') {
-            val += line[i];
-        } else if (!val.empty()) {
-            d.push_back(val);
-            val = "";
-        }
-    }
-    if (!val.empty()) {
-        d.push_back(val);
-    }
-    int vec_size = d.size();
-    for (int i = 0; i < vec_size; i++) {
-        if (d[i].size() >= min_len) {
-            if (digit_map.find(d[i]) != digit_map.end()) {
-                digit_map[d[i]] += 1;
-            } else {
-                digit_map.insert(make_pair(d[i], 1));
-            }
-        }
+/**
+ * the tables of a source for --report, once its counts are saved
+ */
+void report_tables(const TrainingSource &source) {
+    stats.add_source(source.path, source.weight, source.lines, source.bytes);
+    for (int kind = 0; kind < COUNT_KINDS; kind++) {
+        stats.add_table(source.path, COUNT_KIND_NAMES[kind], (long long) source.table_keys[kind],
+                        (long long) source.table_bytes[kind]);
     }
 }
 
-// extract letter part
-void extract_letter(const char *line, int size, unsigned int min_len, std::map<std::string, int> &letter_map) {
-    std::vector<std::string> l;
-    std::string val;
-    for (int i = 0; i < size; i++) {
-        if ((line[i] >= 'a' && line[i] <= 'z') || (line[i] >= 'A' && line[i] <= 'Z')) {
-            val += line[i];
-        } else if (!val.empty()) {
-            l.push_back(val);
-            val = "";
-        }
-    }
-    if (!val.empty()) {
-        l.push_back(val);
-    }
-    int vec_size = l.size();
-    for (int i = 0; i < vec_size; i++) {
-        if (l[i].size() >= min_len) {
-            if (letter_map.find(l[i]) != letter_map.end()) {
-                letter_map[l[i]] += 1;
-            } else {
-                letter_map.insert(make_pair(l[i], 1));
-            }
+// extract structure info
+template<class Table>
+void extract_structure(const Segmenter &segmenter, long long weight, Table &structure_map) {
+    static thread_local std::string structure;
+    segmenter.structure_key(structure);
+    structure_map.add(structure, weight);
+}
+
+// extract digit, letter and special parts, runs shorter than min_len are skipped
+template<class Table>
+void extract_segments(const Segmenter &segmenter, const char *line, int min_len, long long weight,
+                      Table &digit_map, CountTable &letter_map, Table &special_map) {
+    for (const Segment &run : segmenter.segments()) {
+        if (run.length < min_len) {
+            continue;
+        }
+        if (run.cls == CLASS_DIGIT) {
+            digit_map.add(line + run.offset, (size_t) run.length, weight);
+        } else if (run.cls == CLASS_LETTER) {
+            letter_map.add(line + run.offset, (size_t) run.length, weight);
+        } else {
+            special_map.add(line + run.offset, (size_t) run.length, weight);
         }
     }
 }
 
-// extract special part
-void extract_special(const char *line, int size, unsigned int min_len, std::map<std::string, int> &special_map) {
-    std::vector<std::string> s;
-    std::string val;
-    for (int i = 0; i < size; i++) {
-        if (!((line[i] >= 'a' && line[i] <= 'z')
-              || (line[i] >= 'A' && line[i] <= 'Z')
-              || (line[i] >= '0' && line[i] <= '9'))) {
-            val += line[i];
-        } else if (!val.empty()) {
-            s.push_back(val);
-            val = "";
-        }
-    }
-    if (!val.empty()) {
-        s.push_back(val);
-    }
-    int vec_size = s.size();
-    for (int i = 0; i < vec_size; i++) {
-        if (s[i].size() >= min_len) {
-            if (special_map.find(s[i]) != special_map.end()) {
-                special_map[s[i]] += 1;
-            } else {
-                special_map.insert(make_pair(s[i], 1));
-            }
+/**
+ * sort every table of a shard and write it to a run file in spill_dir, the tables are left empty
+ */
+void spill_tables(CountTables &tables) {
+    for (int kind = 0; kind < COUNT_KINDS; kind++) {
+        CountTable &table = tables.table(kind);
+        if (table.empty()) {
+            continue;
+        }
+        std::string run_file;
+        {
+            std::lock_guard<std::mutex> lock(spill_mutex);
+            run_file = spill_dir + "run-" + std::to_string(spill_number++) + ".bin";
+            TrainingSource &source = sources[tables.source];
+            source.spilled_runs[kind].push_back(run_file);
+            source.table_bytes[kind] = std::max(source.table_bytes[kind], table.memory_bytes());
+        }
+        table.sort();
+        std::FILE *fout = std::fopen(run_file.c_str(), "wb");
+        bool ok = fout != nullptr;
+        if (ok) {
+            std::vector<char> buffer(1u << 22u);
+            setvbuf(fout, buffer.data(), _IOFBF, buffer.size());
+            ok = write_count_table(fout, table);
+            ok = std::fclose(fout) == 0 && ok;
         }
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(spill_mutex);
+            spill_failed = true;
+        }
+        table.clear();
     }
 }
 
@@ -372,259 +1304,382 @@ void extract_special(const char *line, int size, unsigned int min_len, std::map<
  * sort the structure with negitive sequence
  */
 bool negative_sort_structure(Structure *e1, Structure *e2) {
-    return e1->getCnt() > e2->getCnt();
+    return e1->getProb() > e2->getProb();
 }
 
 /**
- * write the structure and related probability to file
+ * write the structure and related probability to file.
+ * the probability of a structure is its share of the structures of each source, mixed by weight.
  */
-void process_structure() {
-    std::map<std::string, int>::iterator it;
-    int total_structures_number = 0;
+bool process_structure() {
     std::vector<Structure *> structure_group;
-    for (it = structure_map.begin(); it != structure_map.end(); it++) {
-        auto *s = new Structure(it->first, it->second);
-        structure_group.push_back(s);
-        total_structures_number += it->second;
+    std::vector<CountRunReader> structure_counts(sources.size());
+    std::vector<CountRunReader *> runs;
+    std::vector<long long> totals(sources.size(), 0);
+    double total_weight = 0;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (!open_counts(sources[i], structure_counts[i], COUNT_STRUCTURE)) {
+            return false;
+        }
+        while (structure_counts[i].next()) {
+            totals[i] += structure_counts[i].count();
+        }
+        if (structure_counts[i].failed() || !open_counts(sources[i], structure_counts[i], COUNT_STRUCTURE)) {
+            std::cerr << "[Error] could not read the counts of the model" << std::endl;
+            return false;
+        }
+        runs.push_back(&structure_counts[i]);
+        total_weight += sources[i].weight;
+    }
+    RunJoin join(runs);
+    while (join.next()) {
+        long long count = 0;
+        double prob = 0;
+        for (size_t i = 0; i < sources.size(); i++) {
+            if (join.has(i)) {
+                count += join.count(i);
+                prob += sources[i].weight / total_weight * (1.0 * join.count(i) / totals[i]);
+            }
+        }
+        structure_group.push_back(new Structure(std::string(join.key(), join.size()), count, prob));
+    }
+    if (join.failed()) {
+        std::cerr << "[Error] could not read the counts of the model" << std::endl;
+        for (auto &itr : structure_group) {
+            delete itr;
+        }
+        return false;
     }
-    sort(structure_group.begin(), structure_group.end(), negative_sort_structure);
+    // start from the order of the structures' text, the stable sort keeps it for equal probabilities
+    sort(structure_group.begin(), structure_group.end(), [](Structure *e1, Structure *e2) {
+        return e1->getStr() < e2->getStr();
+    });
+    std::stable_sort(structure_group.begin(), structure_group.end(), negative_sort_structure);
     int size = structure_group.size();
 
-    std::string dir = tmp_model_output_path + "grammar";
-
-    create_dir(dir.c_str());
-    std::ofstream fout_structure((tmp_model_output_path + "grammar" + PATH_DELIMITER + "structures.txt").c_str());
+    if (text_model) {
+        std::string dir = tmp_model_output_path + "grammar";
+
+        create_dir(dir.c_str());
+        std::string structure_file = tmp_model_output_path + "grammar" + PATH_DELIMITER + "structures.txt";
+        BufferedFileWriter fout_structure;
+        fout_structure.open(structure_file);
+        for (int i = 0; i < size; i++) {
+            fout_structure.write(structure_group[i]->getStr());
+            fout_structure.put('\x09');
+            fout_structure.write_number(structure_group[i]->getProb());
+            fout_structure.put('\n');
+        }
+        if (!fout_structure.close()) {
+            std::cerr << "[Error] could not write " << structure_file << std::endl;
+        }
+        // the same structures with packed keys, guess reads these without parsing the text
+        std::string rle_file = tmp_model_output_path + "grammar" + PATH_DELIMITER + "structures.rle";
+        std::FILE *fout_rle = std::fopen(rle_file.c_str(), "wb");
+        bool rle_ok = fout_rle != nullptr && write_structure_header(fout_rle, (uint64_t) size);
+        for (int i = 0; i < size && rle_ok; i++) {
+            std::string key = structure_group[i]->getKey();
+            rle_ok = write_structure_record(fout_rle, structure_group[i]->getProb(), key.data(), (uint32_t) key.size());
+        }
+        if (fout_rle != nullptr) {
+            rle_ok = rle_ok && start_sync(fout_rle);
+            rle_ok = std::fclose(fout_rle) == 0 && rle_ok;
+        }
+        if (!rle_ok) {
+            std::cerr << "[Error] could not write " << rle_file << std::endl;
+            std::remove(rle_file.c_str());
+        }
+    }
+    ModelStructuresBuilder structures;
     for (int i = 0; i < size; i++) {
-        fout_structure << structure_group[i]->getStr() << '\x09' << std::fixed << std::setprecision(30)
-                       << 1.0 * structure_group[i]->getCnt() / total_structures_number << std::endl;
-
+        std::string key = structure_group[i]->getKey();
+        structures.add(structure_group[i]->getProb(), key.data(), key.size());
     }
-    fout_structure.close();
+    model_file.write_structures(structures);
     for (auto &itr : structure_group) {
         delete itr;
     }
     structure_group.clear();
-    structure_map.erase(structure_map.begin(), structure_map.end());
+    return true;
 }
 
 /**
- * sort the digits with negitive sequence
+ * one smoothing pass for digits and specials. the sorted long and short tables of all sources are
+ * merge-joined straight into length buckets. within a source, a key gets
+ * prob_long * weight + prob_short * (1 - weight), where prob_* is its count over the count of all keys
+ * of the same length and weight comes from calc_weight. the sources are mixed by their --training-set weights.
  */
-bool negative_sort_digit(Digit *d1, Digit *d2) {
-    return d1->getProb() > d2->getProb();
+bool smooth_counts(CountKind long_kind, CountKind short_kind, std::vector<LengthBucket> &buckets) {
+    // the long and the short run of source i are runs 2i and 2i + 1
+    std::vector<CountRunReader> counts(2 * sources.size());
+    std::vector<CountRunReader *> runs;
+    std::vector<std::vector<long long> > totals(counts.size());
+    for (size_t r = 0; r < counts.size(); r++) {
+        const TrainingSource &source = sources[r / 2];
+        CountKind kind = r % 2 == 0 ? long_kind : short_kind;
+        if (!open_counts(source, counts[r], kind)) {
+            return false;
+        }
+        while (counts[r].next()) {
+            if (counts[r].size() >= totals[r].size()) {
+                totals[r].resize(counts[r].size() + 1, 0);
+            }
+            totals[r][counts[r].size()] += counts[r].count();
+        }
+        if (counts[r].failed() || !open_counts(source, counts[r], kind)) {
+            std::cerr << "[Error] could not read the counts of the model" << std::endl;
+            return false;
+        }
+        runs.push_back(&counts[r]);
+    }
+    std::vector<float> weights, shares;
+    double total_weight = 0;
+    for (const TrainingSource &source : sources) {
+        total_weight += source.weight;
+    }
+    for (const TrainingSource &source : sources) {
+        weights.push_back(calc_weight(source.useful_set_size));
+        shares.push_back((float) (source.weight / total_weight));
+    }
+    RunJoin join(runs);
+    while (join.next()) {
+        size_t length = join.size();
+        if (length >= buckets.size()) {
+            buckets.resize(length + 1);
+        }
+        LengthBucket &bucket = buckets[length];
+        float prob = 0;
+        for (size_t i = 0; i < sources.size(); i++) {
+            bool is_long = join.has(2 * i), is_short = join.has(2 * i + 1);
+            float prob_long = is_long ? 1.0f * join.count(2 * i) / (float) totals[2 * i][length] : 0;
+            float prob_short = is_short ? 1.0f * join.count(2 * i + 1) / (float) totals[2 * i + 1][length] : 0;
+            float weight = weights[i];
+            if (is_long && is_short) { // both short and long
+                prob += shares[i] * (prob_long * weight + prob_short * (1 - weight));
+            } else if (is_long) { // only long
+                prob += shares[i] * (prob_long * weight);
+            } else if (is_short) { // only short
+                prob += shares[i] * (prob_short * (1 - weight));
+            }
+        }
+        bucket.keys.push_back(SmoothedKey{bucket.pool.size(), prob});
+        bucket.pool.append(join.key(), length);
+    }
+    if (join.failed()) {
+        std::cerr << "[Error] could not read the counts of the model" << std::endl;
+        return false;
+    }
+    return true;
 }
 
 /**
- * transfer the probabilities of digits and write them down to the files
+ * run task(item) for every item on up to threads threads, the items are handed out in order
  */
-void process_digit() {
-    std::map<std::string, int>::iterator it;
-    int arr_size = 256;
-    int total_digit_long_number[arr_size];
-    int total_digit_short_number[arr_size];
-    for (int i = 0; i < arr_size; i++) {
-        total_digit_long_number[i] = 0;
-        total_digit_short_number[i] = 0;
-    }
-    for (it = digit_map_long.begin(); it != digit_map_long.end(); it++) {
-        total_digit_long_number[it->first.size()] += it->second;
-    }
-    for (it = digit_map_short.begin(); it != digit_map_short.end(); it++) {
-        total_digit_short_number[it->first.size()] += it->second;
-    }
-    float weight = calc_weight(useful_set_size);
-    std::vector<Digit *> digit_group;
-
-    for (it = digit_map_long.begin(); it != digit_map_long.end(); it++) {
-        // both short and long
-        if (digit_map_short.find(it->first) != digit_map_short.end()) {
-            float prob_long = 1.0f * it->second / (float) total_digit_long_number[it->first.size()];
-            float prob_short = 1.0f * digit_map_short[it->first] / (float) total_digit_short_number[it->first.size()];
-            float prob_new = prob_long * weight + prob_short * (1 - weight);
-            auto *d = new Digit(it->first, prob_new);
-            digit_group.push_back(d);
-        } else { // only long
-            float prob_long = 1.0f * it->second / (float) total_digit_long_number[it->first.size()];
-            float prob_new = prob_long * weight;
-            auto *d = new Digit(it->first, prob_new);
-            digit_group.push_back(d);
-        }
-    }
-    // only short
-    for (it = digit_map_short.begin(); it != digit_map_short.end(); it++) {
-        if (digit_map_long.find(it->first) == digit_map_long.end()) {
-            float prob_short = 1.0f * it->second / (float) total_digit_short_number[it->first.size()];
-            float prob_new = prob_short * (1 - weight);
-            auto *d = new Digit(it->first, prob_new);
-            digit_group.push_back(d);
-        }
-    }
-    sort(digit_group.begin(), digit_group.end(), negative_sort_digit);
-
-    std::vector<Digit *> digit_groups[arr_size];
-    int size = digit_group.size();
-    std::string dir = tmp_model_output_path + "digits";
-    create_dir(dir.c_str());
-    for (int i = 0; i < size; i++) {
-
-        int length = digit_group[i]->getStr().size();
-
-        digit_groups[length].push_back(digit_group[i]);
-    }
-    for (int i = 0; i < arr_size; i++) {
-        int cur_size = digit_groups[i].size();
-        if (cur_size <= 0) {
-            continue;
+template<typename Task>
+void parallel_for(const std::vector<size_t> &items, int threads, const Task &task) {
+    std::atomic<size_t> next(0);
+    auto worker = [&items, &task, &next]() {
+        for (size_t n = next++; n < items.size(); n = next++) {
+            task(items[n]);
         }
-        std::stringstream ss;
-        ss << i;
-        std::string number;
-        ss >> number;
-//        std::string digit_file = (tmp_model_output_path.append("digits").append(
-//                reinterpret_cast<const char *>(PATH_DELIMITER)).append(number).append(".txt"));
-        std::string digit_file = tmp_model_output_path;
-        digit_file += "digits";
-        digit_file += PATH_DELIMITER;
-        digit_file += number;
-        digit_file += ".txt";
-        std::ofstream fout_i(digit_file.c_str());
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && (size_t) t < items.size(); t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : workers) {
+        thread.join();
+    }
+}
 
-        for (int j = 0; j < cur_size; j++) {
-            fout_i << digit_groups[i][j]->getStr() << '\x09' << std::fixed << std::setprecision(30)
-                   << digit_groups[i][j]->getProb() << std::endl;
-            delete digit_groups[i][j];
+/**
+ * the lengths that have keys, the ones with the most keys first so that they do not end up last on a thread
+ */
+std::vector<size_t> largest_buckets_first(const std::vector<LengthBucket> &buckets) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (!buckets[i].keys.empty()) {
+            order.push_back(i);
         }
-        digit_groups[i].clear();
     }
-
-    digit_group.clear();
-    digit_map_long.erase(digit_map_long.begin(), digit_map_long.end());
-    digit_map_short.erase(digit_map_short.begin(), digit_map_short.end());
+    std::stable_sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+        return buckets[a].keys.size() > buckets[b].keys.size();
+    });
+    return order;
 }
 
 /**
- * sort the special with negative sequence
+ * sort every bucket by probability, equal ones by key
  */
-bool negative_sort_special(Special *s1, Special *s2) {
-    return s1->getProb() > s2->getProb();
+void sort_buckets(std::vector<LengthBucket> &buckets, int threads) {
+    parallel_for(largest_buckets_first(buckets), threads, [&buckets](size_t length) {
+        LengthBucket &bucket = buckets[length];
+        const char *pool = bucket.pool.data();
+        std::sort(bucket.keys.begin(), bucket.keys.end(), [pool, length](const SmoothedKey &a, const SmoothedKey &b) {
+            return a.prob > b.prob || (a.prob == b.prob && memcmp(pool + a.offset, pool + b.offset, length) < 0);
+        });
+    });
 }
 
 /**
- * transfer the probabilities of special and write them down to the files
+ * transfer the probabilities of digits or specials and write them down to folder/N.txt,
+ * one file per length, and to their section of model.bin.
+ * every length file is written by its own task.
  */
-void process_special() {
-    std::map<std::string, int>::iterator it;
-    int arr_size = 256;
-    int total_special_long_number[arr_size];
-    int total_special_short_number[arr_size];
-    for (int i = 0; i < arr_size; i++) {
-        total_special_long_number[i] = 0;
-        total_special_short_number[i] = 0;
-    }
-    for (it = special_map_long.begin(); it != special_map_long.end(); it++) {
-        total_special_long_number[it->first.size()] += it->second;
-    }
-    for (it = special_map_short.begin(); it != special_map_short.end(); it++) {
-        total_special_short_number[it->first.size()] += it->second;
-    }
-    float weight = calc_weight(useful_set_size);
-    std::vector<Special *> special_group;
-
-    for (it = special_map_long.begin(); it != special_map_long.end(); it++) {
-        // both short and long
-        if (special_map_short.find(it->first) != special_map_short.end()) {
-            float prob_long = 1.0f * it->second / (float) total_special_long_number[it->first.size()];
-            float prob_short =
-                    1.0f * special_map_short[it->first] / (float) total_special_short_number[it->first.size()];
-            float prob_new = prob_long * weight + prob_short * (1 - weight);
-            auto *d = new Special(it->first, prob_new);
-            special_group.push_back(d);
-        } else { // only long
-            float prob_long = 1.0f * it->second / (float) total_special_long_number[it->first.size()];
-            float prob_new = prob_long * weight;
-            auto *d = new Special(it->first, prob_new);
-            special_group.push_back(d);
-        }
-    }
-    // only short
-    for (it = special_map_short.begin(); it != special_map_short.end(); it++) {
-        if (special_map_long.find(it->first) == special_map_long.end()) {
-            float prob_short = 1.0f * it->second / (float) total_special_short_number[it->first.size()];
-            float prob_new = prob_short * (1 - weight);
-            auto *d = new Special(it->first, prob_new);
-            special_group.push_back(d);
-        }
-    }
-    sort(special_group.begin(), special_group.end(), negative_sort_special);
-
-    std::vector<Special *> special_groups[arr_size];
-    int size = special_group.size();
-    std::string dir = tmp_model_output_path + "special";
-    create_dir(dir.c_str());
-    for (int i = 0; i < size; i++) {
-        int length = special_group[i]->getStr().size();
-        special_groups[length].push_back(special_group[i]);
+bool process_terminals(CountKind long_kind, CountKind short_kind, const char *folder, ModelTerminalKind model_kind) {
+    std::vector<LengthBucket> buckets;
+    {
+        TrainStats::Phase phase(stats, std::string(folder) + ": smoothing");
+        if (!smooth_counts(long_kind, short_kind, buckets)) {
+            return false;
+        }
     }
-    for (int i = 0; i < arr_size; i++) {
-        int cur_size = special_groups[i].size();
-        if (cur_size <= 0) {
-            continue;
+    {
+        TrainStats::Phase phase(stats, std::string(folder) + ": sorting");
+        sort_buckets(buckets, training_threads);
+    }
+    TrainStats::Phase phase(stats, std::string(folder) + ": writing");
+    if (text_model) {
+        std::string dir = tmp_model_output_path + folder;
+        create_dir(dir.c_str());
+        std::atomic<bool> write_failed(false);
+        parallel_for(largest_buckets_first(buckets), training_threads, [&buckets, &dir, &write_failed](size_t length) {
+            const LengthBucket &bucket = buckets[length];
+            BufferedFileWriter fout_i;
+            fout_i.open(dir + PATH_DELIMITER + std::to_string(length) + ".txt");
+            for (const SmoothedKey &key : bucket.keys) {
+                fout_i.write(bucket.pool.data() + key.offset, length);
+                fout_i.put('\x09');
+                fout_i.write_number(key.prob);
+                fout_i.put('\n');
+            }
+            if (!fout_i.close()) {
+                write_failed = true;
+            }
+        });
+        if (write_failed) {
+            std::cerr << "[Error] could not write " << dir << std::endl;
         }
-        std::stringstream ss;
-        ss << i;
-        std::string number;
-        ss >> number;
-//        std::string special_file = tmp_model_output_path.append("special").append(
-//                reinterpret_cast<const char *>(PATH_DELIMITER)).append(number).append(".txt");
-        std::string special_file = tmp_model_output_path;
-        special_file += "special";
-        special_file += PATH_DELIMITER;
-        special_file += number;
-        special_file += ".txt";
-        std::ofstream fout_i(special_file.c_str());
-
-        for (int j = 0; j < cur_size; j++) {
-            fout_i << special_groups[i][j]->getStr() << '\x09' << std::fixed << std::setprecision(30)
-                   << special_groups[i][j]->getProb() << std::endl;
-            delete special_groups[i][j];
+    }
+    ModelTerminalsBuilder terminals;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        const LengthBucket &bucket = buckets[i];
+        for (const SmoothedKey &key : bucket.keys) {
+            terminals.add((int) i, key.prob, bucket.pool.data() + key.offset, i);
         }
-        special_groups[i].clear();
     }
+    model_file.write_terminals(model_kind, terminals);
+    return true;
+}
 
-    special_group.clear();
-    special_map_long.erase(special_map_long.begin(), special_map_long.end());
-    special_map_short.erase(special_map_short.begin(), special_map_short.end());
+/**
+ * transfer the probabilities of digits and write them down to the files
+ */
+bool process_digit() {
+    return process_terminals(COUNT_DIGIT_LONG, COUNT_DIGIT_SHORT, "digits", MODEL_DIGITS);
 }
 
 /**
- * mix with dictionary and write them down to the files
+ * transfer the probabilities of special and write them down to the files
  */
-void process_letter() {
-    std::map<std::string, int>::iterator it;
-    for (it = letter_map_short.begin(); it != letter_map_short.end(); it++) {
-        if (letter_map_long.find(it->first) == letter_map_long.end()) {
-            letter_map_long.insert(make_pair(it->first, it->second));
+bool process_special() {
+    return process_terminals(COUNT_SPECIAL_LONG, COUNT_SPECIAL_SHORT, "special", MODEL_SPECIAL);
+}
+
+/**
+ * mix with dictionary and write them down to the files.
+ * the letters of the training sets are streamed from the sorted long and short tables into dictionary.txt
+ * and a KeySet, then the external dictionary is streamed after them, leaving out every word that is
+ * already in the set, so each word is written once.
+ */
+bool process_letter() {
+    KeySet words;
+    DictionaryModel dictionary;
+    std::string letter_file = (model_output_path + "dictionary.txt");
+    BufferedFileWriter fout_letter;
+    if (text_model) {
+        fout_letter.open(letter_file);
+    }
+    // without the text model the words go straight to the dictionary model instead of through dictionary.txt
+    auto add_word = [&fout_letter, &dictionary](const char *word, size_t size) {
+        if (text_model) {
+            fout_letter.write(word, size);
+            fout_letter.put('\n');
+        } else {
+            dictionary.add(word, (int) size, true);
+        }
+    };
+    CountMerger trained_letters;
+    for (const TrainingSource &source : sources) {
+        if (source.in_memory) {
+            trained_letters.add_table(source.counts.table(COUNT_LETTER_LONG));
+            trained_letters.add_table(source.counts.table(COUNT_LETTER_SHORT));
+        } else {
+            trained_letters.add_run(source.counts_file, source.counts_output.offsets[COUNT_LETTER_LONG]);
+            trained_letters.add_run(source.counts_file, source.counts_output.offsets[COUNT_LETTER_SHORT]);
         }
     }
-    std::string letter_file = (model_output_path + "dictionary.txt");
-    std::ofstream fout_letter(letter_file.c_str());
-    for (it = letter_map_long.begin(); it != letter_map_long.end(); it++) {
-        fout_letter << it->first << std::endl;
-    }
-    std::ifstream fin_dict(external_dict_path.c_str());
-    if (fin_dict.is_open()) {
-        std::string line;
-        while (!fin_dict.eof()) {
-            getline(fin_dict, line);
-            if (letter_map_long.find(line) == letter_map_long.end()) {
-                fout_letter << line << std::endl;
+    while (trained_letters.next()) {
+        add_word(trained_letters.key(), trained_letters.size());
+        words.insert(trained_letters.key(), trained_letters.size());
+    }
+    if (trained_letters.failed()) {
+        std::cerr << "[Error] could not read the counts of the model" << std::endl;
+        return false;
+    }
+    CorpusReader fin_dict;
+    if (fin_dict.open(external_dict_path.c_str())) {
+        fin_dict.for_each_line([&words, &add_word](const char *line, int size) {
+            if (size > 0 && line[size - 1] == '\r') {
+                size--;
+            }
+            if (size > 0 && words.insert(line, (size_t) size)) {
+                add_word(line, (size_t) size);
             }
+        });
+        if (fin_dict.failed()) {
+            std::cerr << "[Dict]: " << external_dict_path << " is corrupt or cut off" << std::endl;
         }
+    } else if (fin_dict.compression() != COMPRESSION_NONE) {
+        std::cerr << "[Dict]: this build cannot read " << compression_name(fin_dict.compression()) << std::endl;
     }
     fin_dict.close();
-    fout_letter.close();
-    letter_map_long.erase(letter_map_long.begin(), letter_map_long.end());
-    letter_map_short.erase(letter_map_short.begin(), letter_map_short.end());
+    words.clear();
+    // the model is made of dictionary.txt as it was written, the words may point into it until it is built
+    CorpusReader reader;
+    if (text_model) {
+        if (!fout_letter.close()) {
+            std::cerr << "[Error] could not write " << letter_file << std::endl;
+        }
+        if (reader.open(letter_file.c_str())) {
+            reader.for_each_line([&dictionary, &reader](const char *line, int size) {
+                dictionary.add(line, size, !reader.is_mapped());
+            });
+        }
+    }
+    ModelTerminalsBuilder letters;
+    dictionary.build(letters);
+    model_file.write_terminals(MODEL_LETTERS, letters);
+    return true;
+}
+
+/**
+ * the sections of model.bin, made from the merged counts of the sources.
+ * false if the counts could not be read, the model is not complete then
+ */
+bool build_model() {
+    {
+        TrainStats::Phase phase(stats, "structures");
+        if (!process_structure()) {
+            return false;
+        }
+    }
+    if (!process_digit() || !process_special()) {
+        return false;
+    }
+    TrainStats::Phase phase(stats, "letters");
+    return process_letter();
 }
 
 /**
@@ -649,49 +1704,13 @@ void create_dir(const char *dir) {
 /**
  * get the weight to be assigned to prob_long
  */
-float calc_weight(int size) {
+float calc_weight(long long size) {
     int d = (int) ((1 / (1 + exp(10 - 2 * log10(size))) + 0.05) * 10);
     float w = (float) d / 10.0f;
     return w;
 }
 
 
-int get_training_set_size(const char *training_set) {
-    std::ifstream input_training;
-    input_training.open(training_set);
-    int set_size = 0;
-    if (!input_training.is_open()) {
-        std::cerr << "[Training set]: Could not open file " << training_set << std::endl;
-        return -1;
-    }
-
-    std::string line;
-    while (!input_training.eof()) {
-        getline(input_training, line);
-        int size = line.size();
-        if (size <= 0) {
-            continue;
-        }
-        set_size += 1;
-    }
-    input_training.close();
-
-    std::ifstream input_dict;
-    input_dict.open(external_dict_path.c_str());
-    if (!input_dict.is_open()) {
-        std::cerr << "[Dict]: Could not open file " << external_dict_path << std::endl;
-        std::cout << "will not use dictionary" << std::endl;
-        dictionary_size = 0;
-    } else {
-        while (!input_dict.eof()) {
-            getline(input_dict, line);
-            dictionary_size += 1;
-        }
-    }
-    input_dict.close();
-    return set_size;
-}
-
 int rm_dir(const std::string &dir_full_path) {
     DIR *dirp = opendir(dir_full_path.c_str());
     if (!dirp) {